@@ -20,13 +20,20 @@
 #include "src/AdafruitBME280/Adafruit_Sensor.h"
 #include "src/AdafruitBME280/Adafruit_BME280.h"
 #include "src/pmsLibrary/PMS.h"
-#include "src/movingAvg/movingAvg.h"
+#include "src/sensorAggregator/sensorAggregator.h"
+#include "src/loopTiming/loopTiming.h"
+#include "src/taskScheduler/taskScheduler.h"
+#include "src/reconnectPolicy/reconnectPolicy.h"
+#include "src/humidityMath/humidityMath.h"
+#include "src/sensorOutbox/sensorOutbox.h"
 #include "src/WiFiManager/WiFiManager.h"
 #include "src/PubSubClient/PubSubClient.h"
 #include "src/ArduinoJson-v6.18.5.h"
 #include <SoftwareSerial.h>
 #include <Wire.h>
 #include <EEPROM.h>
+#include <LittleFS.h>
+#include <sys/time.h>
 
 #define BUTTON_PIN     0
 #define pmsTX          D5
@@ -38,9 +45,16 @@ const char*    firmwareVersionPortal   = "<p>Firmware Version: 2.1.1</p>";
 char           klimerkoID[32];
 
 // -------------------------- WiFi ------------------------------------------------------
-const int      wifiReconnectInterval   = 60;
+const int      wifiReconnectMin        = 30;  // [SECONDS] Shortest time between retries, it doubles with every failed retry
+const int      wifiReconnectMax        = 600; // [SECONDS] Longest time between retries
 bool           wifiConnectionLost      = true;
-unsigned long  wifiReconnectLastAttempt;
+const uint16_t wifiFastConnectTimeout  = 3000;  // (milliseconds) Longest wait for a direct connection to the last access point before scanning for it
+bool           wifiCacheValid          = false; // Channel, BSSID and IP lease of the last connection are known
+uint8_t        wifiCacheChannel;
+uint8_t        wifiCacheBssid[6];
+uint32_t       wifiCacheAddresses[4];            // IP, gateway, subnet mask and DNS server of the last DHCP lease
+unsigned long  wifiLostSince           = 0;      // When connection was lost (0 for boot), to report how long it took to publish again
+bool           wifiOfflineTimed        = false;
 
 // ------------------- WiFi Configuration Portal ----------------------------------------
 char const     *wifiConfigPortalPassword = "ConfigMode"; // Password for WiFi Configuration Portal WiFi Network
@@ -53,22 +67,35 @@ const uint16_t MQTT_PORT               = 1883;
 const char*    MQTT_PASSWORD           = "arbitrary";
 uint16_t       MQTT_MAX_MESSAGE_SIZE   = 2048;
 char           deviceId[32], deviceToken[64];
+const uint8_t  mqttSensorDataQos       = 1;  // QoS 1 makes the broker confirm sensor data, unconfirmed data is resent after reconnecting
 
-const int      mqttReconnectInterval   = 30; // Seconds between retries
+const int      mqttReconnectMin        = 15;  // [SECONDS] Shortest time between retries, it doubles with every failed retry
+const int      mqttReconnectMax        = 600; // [SECONDS] Longest time between retries
+const int      mqttConnectTimeout      = 3000; // [MILLISECONDS] Longest the loop may wait for the network connection to the broker to open
 bool           mqttConnectionLost      = true;
-unsigned long  mqttReconnectLastAttempt;
-
-char*          PM1_ASSET               = "pm1";
-char*          PM2_5_ASSET             = "pm2-5";
-char*          PM10_ASSET              = "pm10";
-char*          AQ_ASSET                = "air-quality";
-char*          TEMPERATURE_ASSET       = "temperature";
-char*          TEMP_OFFSET_ASSET       = "temperature-offset";
-char*          HUMIDITY_ASSET          = "humidity";
-char*          PRESSURE_ASSET          = "pressure";
-char*          INTERVAL_ASSET          = "interval";
-char*          FIRMWARE_ASSET          = "firmware";
-char*          WIFI_SIGNAL_ASSET       = "wifi-signal";
+bool           mqttConnecting          = false; // Connection attempt in progress, advanced by mqtt.loop()
+
+const char*    PM1_ASSET               = "pm1";
+const char*    PM2_5_ASSET             = "pm2-5";
+const char*    PM10_ASSET              = "pm10";
+const char*    AQ_ASSET                = "air-quality";
+const char*    TEMPERATURE_ASSET       = "temperature";
+const char*    TEMP_OFFSET_ASSET       = "temperature-offset";
+const char*    HUMIDITY_ASSET          = "humidity";
+const char*    PRESSURE_ASSET          = "pressure";
+const char*    DEW_POINT_ASSET         = "dew-point";
+const char*    ABS_HUMIDITY_ASSET      = "absolute-humidity";
+const char*    INTERVAL_ASSET          = "interval";
+const char*    FIRMWARE_ASSET          = "firmware";
+const char*    WIFI_SIGNAL_ASSET       = "wifi-signal";
+const char*    LOOP_TIMING_ASSET       = "loop-timing";
+const char*    SAMPLES_ASSET           = "samples";
+const char*    SAMPLE_COUNT_ASSET      = "sample-count";
+const char*    SAMPLE_PERIOD_ASSET     = "sample-period";
+const char*    PMS_WAKE_ASSET          = "pms-wake-before";
+const char*    PUBLISH_NOW_ASSET       = "publish-now";
+const char*    REBOOT_ASSET            = "reboot";
+const char*    RECONNECTS_ASSET        = "reconnects";
 
 // -------------------------- BUTTON ------------------------------------------------------
 const int      buttonLongPressTime     = 15000; // (milliseconds) Everything above this is considered a long press
@@ -89,17 +116,40 @@ unsigned long  ledLastUpdate;
 
 // --------------------- SENSORS (GENERAL) ------------------------------------------------
 uint8_t        dataPublishInterval     = 15;    // [MINUTES] Default sensor data sending interval
-const uint8_t  sensorAverageSamples    = 10;    // Number of samples used to average values from sensors
+const uint8_t  sensorAverageSamplesMax = 20;    // Most samples that can be averaged (set remotely up to this)
+const uint8_t  sensorAverageSamplesMin = 1;
+uint8_t        sensorAverageSamples    = 10;    // Number of samples used to average values from sensors
+uint16_t       sensorSamplePeriod      = 0;     // [SECONDS] Time between sensor readings. 0 spreads sensorAverageSamples readings over the publish interval.
+const uint16_t sensorSamplePeriodMax   = 3600;  // [SECONDS] Allowed range when set remotely (besides 0)
+const uint16_t sensorSamplePeriodMin   = 10;
 const int      sensorRetriesUntilConsideredOffline = 3;
+const uint8_t  SENSOR_PM1              = 0;     // Channels of sensor aggregator
+const uint8_t  SENSOR_PM2_5            = 1;
+const uint8_t  SENSOR_PM10             = 2;
+const uint8_t  SENSOR_TEMPERATURE      = 3;
+const uint8_t  SENSOR_HUMIDITY         = 4;
+const uint8_t  SENSOR_PRESSURE         = 5;
+const uint8_t  sensorChannels          = 6;
 bool           dataPublishFailed       = false; // Keeps track if a payload has failed to send so we can retry
+bool           dataPublishNow          = false; // Send sensor data on next loop instead of waiting for the interval
+bool           dataBatchMode           = false; // Also publish every reading taken during the interval (with its time), not just the averages
+uint8_t        dataBatchCount          = 0;     // Number of readings kept for batch publishing
+const uint8_t  dataBatchChunk          = 10;    // Readings per samples message, so one fits what MQTT keeps for resending (MQTT_INFLIGHT_PACKET_SIZE)
+bool           dataMsgPack             = false; // Publish state as MessagePack instead of JSON (smaller, no float formatting). Device on AllThingsTalk must be set to accept it.
 unsigned long  sensorReadTime, dataPublishTime;
 
 // -------------------------- PMS7003 -----------------------------------------------------
-const uint8_t  pmsWakeBefore           = 30;    // [SECONDS] Seconds PMS sensor should be active before reading it
+uint8_t        pmsWakeBefore           = 30;    // [SECONDS] Seconds PMS sensor should be active before reading it
+const uint8_t  pmsWakeBeforeMin        = 10;    // [SECONDS] Allowed range when set remotely
+const uint8_t  pmsWakeBeforeMax        = 120;
+const uint8_t  pmsMinSleep             = 30;    // [SECONDS] Shorter sleep than this isn't worth stopping and restarting the fan for
+const uint16_t pmsFanLifetime          = 8000;  // [HOURS] Approximate running time PMS7003 fan and laser are good for
 bool           pmsSensorOnline         = true;
 int            pmsSensorRetry          = 0;
 bool           pmsNoSleep              = false;
 bool           pmsWoken                = false;
+bool           pmsSleepPending         = false;
+const int      pmsSleepDelay           = 100;   // (milliseconds) Time between flushing serial and putting PMS sensor to sleep
 const char     *airQuality, *airQualityRaw;
 int            avgPM1, avgPM25, avgPM10;
 
@@ -107,15 +157,86 @@ int            avgPM1, avgPM25, avgPM10;
 bool           bmeSensorOnline                = true;
 int            bmeSensorRetry                 = 0;
 float          bmeTemperatureOffset           = -4;   // Default temperature offset
+int32_t        bmeTemperatureOffsetFixed      = -400; // Same in 0.01 °C, for the integer reading path
 char           bmeTemperatureOffsetChar[8];           // Used for WiFi Configuration Portal and memory
 const char     bmeTemperatureOffsetDefault[8] = "-4"; // Used for WiFi Configuration Portal and memory
 const int      bmeTemperatureOffsetMax        = 25;
 const int      bmeTemperatureOffsetMin        = -25;
-float          avgTemperature, avgHumidity, avgPressure;
+int32_t        temperatureRaw;                        // 0.01 °C, as BME280 measured it
+uint32_t       humidityRaw;                           // % * 1024 (Q22.10), as BME280 measured it
+int32_t        avgTemperature, avgHumidity, avgPressure; // 0.01 °C, 0.01 %, 0.01 mbar (Pa)
+struct bmeSettings {                                   // Oversampling and IIR filter of a deployment profile
+  const char*                      name;
+  Adafruit_BME280::sensor_sampling temperature, pressure, humidity;
+  Adafruit_BME280::sensor_filter   filter;
+};
+const bmeSettings bmeProfiles[] = {
+  { "weather", Adafruit_BME280::SAMPLING_X1,  Adafruit_BME280::SAMPLING_X1,  Adafruit_BME280::SAMPLING_X1,  Adafruit_BME280::FILTER_OFF }, // Datasheet's weather monitoring settings, least power (~9 ms)
+  { "smooth",  Adafruit_BME280::SAMPLING_X2,  Adafruit_BME280::SAMPLING_X4,  Adafruit_BME280::SAMPLING_X2,  Adafruit_BME280::FILTER_X2 },  // Less noise, e.g. for windy or busy locations (~21 ms)
+  { "precise", Adafruit_BME280::SAMPLING_X16, Adafruit_BME280::SAMPLING_X16, Adafruit_BME280::SAMPLING_X16, Adafruit_BME280::FILTER_X4 }   // Lowest noise, for mains powered Klimerko (~113 ms)
+};
+const uint8_t  bmeProfile                     = 0;    // Which of bmeProfiles this Klimerko uses
+bool           pmsReadDone                    = false; // PMS7003 reading arrived, processed once BME280 is done measuring too
+bool           pmsReadReceived;
+
+// -------------------------- LOOP -------------------------------------------------------
+const uint8_t  LOOP_STAGE_SENSOR       = 0;
+const uint8_t  LOOP_STAGE_WIFI         = 1;
+const uint8_t  LOOP_STAGE_MQTT         = 2;
+const uint8_t  LOOP_STAGE_WIFI_CONFIG  = 3;
+const uint8_t  LOOP_STAGE_BUTTON       = 4;
+const uint8_t  LOOP_STAGE_LED          = 5;
+const uint8_t  LOOP_STAGE_TOTAL        = 6;  // Whole loop() iteration
+const uint8_t  loopStageCount          = 7;
+const char*    loopStageNames[loopStageCount] = { "sensor", "wifi", "mqtt", "wifi-config", "button", "led", "loop" };
+const bool     loopTimingSerialDump    = false; // Print timing of every loop stage along with sensor data
+const uint16_t loopStagePeriods[LOOP_STAGE_TOTAL] = { 20, 1000, 10, 10, 20, 50 }; // (milliseconds) How often each loop stage runs
+const uint16_t loopMaxIdle             = 10;    // (milliseconds) Longest the loop waits for the next stage to be due
+uint8_t        loopStageTasks[LOOP_STAGE_TOTAL];
+
+// -------------------------- DEEP SLEEP -------------------------------------------------
+bool           deepSleepMode           = false; // Sleep between readings, for battery/solar powered Klimerko. Needs D0 wired to RST.
+const uint8_t  deepSleepConnectTimeout = 20;    // [SECONDS] Longest a wake-up that publishes waits for the connection to AllThingsTalk
+const uint16_t deepSleepFlushTimeout   = 3000;  // (milliseconds) Longest it waits for AllThingsTalk to confirm data before sleeping
+const uint16_t deepSleepCheckInterval  = 100;   // (milliseconds) How often it checks if it's time to sleep
+bool           deepSleepPublishing     = false; // This wake-up publishes data (and connects to WiFi for it)
+bool           deepSleepReadDone       = false;
+unsigned long  deepSleepFlushStart;
+struct sleepState {                              // Kept in RTC memory, which survives deep sleep
+  uint32_t     crc;                              // Of everything below
+  uint32_t     time;                             // Unix time at wake-up, 0 if the clock wasn't set
+  uint16_t     readings;                         // Readings taken since data was last published (up to 360 with a 10 second sample period)
+  uint8_t      rows;                             // Rows of averaging window kept
+  int16_t      window[sensorAverageSamplesMax][sensorChannels]; // Averaging window (oldest first), divided by sleepStateDivisor
+};
+const int16_t  sleepStateDivisor[sensorChannels] = { 1, 1, 1, 1, 1, 10 }; // Pressure is kept in 0.1 mbar to fit
+sleepState     sleepData;
+struct bmeCalibrationCache {                     // BME280 coefficients, kept in RTC memory after the sleep state so warm boots and wake-ups skip reading them
+  uint32_t          crc;                         // Of everything below
+  bme280_calib_data calibration;
+};
+bmeCalibrationCache bmeCalibration;
+const uint8_t  bmeCalibrationBlock     = (sizeof(sleepState) + 3) / 4; // RTC memory is addressed in 4 byte blocks
+// Estimates of current draw, for the energy report
+const float    energyWiFiCurrent       = 80;    // [mA] ESP8266 awake with WiFi on
+const float    energyAwakeCurrent      = 20;    // [mA] ESP8266 awake with radio off
+const float    energySleepCurrent      = 0.1;   // [mA] Deep sleep (depends a lot on the board)
+const float    energyPmsCurrent        = 100;   // [mA] PMS7003 fan and laser running
+const uint8_t  energyPublishTime       = 8;     // [SECONDS] Typical time to connect and publish
+
+// -------------------------- OUTBOX -----------------------------------------------------
+const uint8_t  outboxDrainBatch        = MQTT_MAX_INFLIGHT; // Number of stored data points sent at once when connection is back, as many as can wait for confirmation
+const int      outboxDrainInterval     = 1000;  // (milliseconds) Time between sending batches of stored data points
+unsigned long  outboxDrainTime;
+uint8_t        outboxPending = 0;               // Stored data points sent but not yet confirmed by AllThingsTalk, they stay stored until then
+uint32_t       outboxPendingDropped;            // Publishes MQTT had given up on when they were sent
+uint32_t       outboxPendingDrops;              // Segments the outbox had dropped when they were sent
 
 // -------------------------- MEMORY -----------------------------------------------------
 const uint16_t EEPROM_attStartAddress  = 0;
 const uint16_t EEPROMsize              = 256;
+const uint16_t EEPROM_settingsAddress  = EEPROM_attStartAddress+sizeof(deviceId)+sizeof(deviceToken)+3+sizeof(bmeTemperatureOffsetChar)+3; // Settings changed over MQTT
+const uint16_t EEPROM_wifiCacheAddress = EEPROM_settingsAddress+sizeof(sensorAverageSamples)+sizeof(pmsWakeBefore)+sizeof(sensorSamplePeriod)+3; // Last WiFi connection
 
 // -------------------------- OBJECTS -----------------------------------------------------
 WiFiManager wm;
@@ -125,21 +246,37 @@ WiFiManagerParameter portalTemperatureOffset("temperature_offset", "Temperature
 WiFiManagerParameter portalDisplayFirmwareVersion(firmwareVersionPortal);
 WiFiManagerParameter portalDisplayCredits("Firmware Designed and Developed by Vanja Stanic");
 WiFiClient networkClient;
+reconnectPolicy wifiReconnect(wifiReconnectMin * 1000UL, wifiReconnectMax * 1000UL);
+reconnectPolicy mqttReconnect(mqttReconnectMin * 1000UL, mqttReconnectMax * 1000UL);
 PubSubClient mqtt(networkClient);
 SoftwareSerial pmsSerial(pmsTX, pmsRX);
 PMS pms(pmsSerial);
 PMS::DATA data;
 Adafruit_BME280 bme;
-movingAvg pm1(sensorAverageSamples);
-movingAvg pm25(sensorAverageSamples);
-movingAvg pm10(sensorAverageSamples);
-movingAvg temp(sensorAverageSamples);
-movingAvg hum(sensorAverageSamples);
-movingAvg pres(sensorAverageSamples);
+loopTiming loopTimings[loopStageCount];
+taskScheduler scheduler;
+SensorOutbox outbox(LittleFS, "/outbox");
+SensorOutbox::RECORD dataBatch[sensorAverageSamplesMax];
+// Sensor data message: 11 assets plus room for firmware version and WiFi signal strings, or one chunk of batch mode samples. Global as it's too big for the stack.
+// Temperature, humidity, pressure, dew point and absolute humidity are copied in as text for JSON (up to 8 characters each), see setFixedValue().
+const size_t sensorDocAverages = JSON_OBJECT_SIZE(11) + 11 * JSON_OBJECT_SIZE(1) + 32 + 5 * 8;
+const size_t sensorDocSamples  = 2 * JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(dataBatchChunk) + dataBatchChunk * JSON_ARRAY_SIZE(7) + dataBatchChunk * 3 * 8;
+const size_t sensorDocCapacity = sensorDocAverages > sensorDocSamples ? sensorDocAverages : sensorDocSamples;
+StaticJsonDocument<sensorDocCapacity> sensorDoc;
+SensorAggregator<sensorChannels, sensorAverageSamplesMax> sensorAvg;
 
 void sensorLoop() { // Reads and publishes sensor data and wakes up pms sensor in predefined intervals
+  // Collect PMS7003 data that arrived since last loop
+  pms.process();
+
+  // Process readings once both sensors are done
+  if (pmsReadDone && bme.measurementReady()) {
+    pmsReadDone = false;
+    readSensorDataFinished(pmsReadReceived);
+  }
+
   // Check if it's time to wake up PMS7003
-  if (millis() - sensorReadTime >= readIntervalMillis() - (pmsWakeBefore * 1000) && !pmsWoken && pmsSensorOnline) {
+  if (millis() - sensorReadTime >= readIntervalMillis() - min(pmsWakeBefore * 1000UL, readIntervalMillis()) && !pmsWoken && pmsSensorOnline) {
     Serial.println("[PMS] Now waking up Air Quality Sensor");
     pmsPower(true);
   }
@@ -151,31 +288,70 @@ void sensorLoop() { // Reads and publishes sensor data and wakes up pms sensor i
   }
 
   // Send average sensor data
-  if (millis() - dataPublishTime >= dataPublishInterval * 60000) {
+  if ((millis() - dataPublishTime >= dataPublishInterval * 60000 || dataPublishNow) && !deepSleepMode) {
+    dataPublishNow = false;
     if (!wifiConnectionLost) {
       if (!mqttConnectionLost) {
         dataPublishFailed = false;
         dataPublishTime = millis();
         publishSensorData();
+        publishLoopTimingData();
       } else {
         if (!dataPublishFailed) {
           Serial.println("[DATA] Can't send sensor data because Klimerko is not connected to AllThingsTalk");
           dataPublishFailed = true;
         }
+        dataPublishTime = millis();
+        storeSensorData();
       }
     } else {
       if (!dataPublishFailed) {
         Serial.println("[DATA] Can't send sensor data because Klimerko is not connected to WiFi");
         dataPublishFailed = true;
       }
+      dataPublishTime = millis();
+      storeSensorData();
     }
   }
+
+  // Send sensor data stored while there was no connection
+  if (outbox.available() > 0 && !wifiConnectionLost && !mqttConnectionLost && millis() - outboxDrainTime >= outboxDrainInterval) {
+    outboxDrainTime = millis();
+    publishStoredSensorData();
+  }
+}
+
+void readSensorData() { // Requests data from PMS7003 and starts a BME280 measurement, the rest happens in readSensorDataFinished() once both are done
+  if (pms.isReading() || pmsReadDone) {
+    Serial.println("[PMS] Previous Air Quality Sensor reading still in progress, skipping this one.");
+    return;
+  }
+  bme.startForcedMeasurement();
+  pms.readAsync(data, pmsReadFinished);
+}
+
+void pmsReadFinished(bool pmsDataReceived) { // PMS7003 responded (or timed out), sensorLoop() waits for BME280 before processing
+  pmsReadReceived = pmsDataReceived;
+  pmsReadDone = true;
 }
 
-void readSensorData() {
+void readSensorDataFinished(bool pmsDataReceived) {
+  int32_t readings[sensorChannels]; // Fixed point: µg/m³, 0.01 °C, 0.01 %, 0.01 mbar
+  for (int i=0;i<sensorChannels;i++) {
+    readings[i] = SENSOR_MISSING; // Stays missing for sensors that returned no data
+  }
   Serial.println("------------------------------DATA------------------------------");
-  readPMS();
-  readBME();
+  readPMS(pmsDataReceived, readings);
+  readBME(readings);
+  averageSensorData(readings);
+  batchSensorData(readings);
+  if (readings[SENSOR_PM10] != SENSOR_MISSING) {
+    printPMS(readings);
+  }
+  if (readings[SENSOR_TEMPERATURE] != SENSOR_MISSING) {
+    printBME(readings);
+  }
+  printLoopTiming();
   Serial.println("----------------------------------------------------------------");
   if (!pmsNoSleep && pmsSensorOnline) {
     Serial.print("[PMS] Air Quality Sensor will sleep until ");
@@ -183,11 +359,15 @@ void readSensorData() {
     Serial.println(" seconds before next reading.");
     pmsPower(false);
   }
+  if (deepSleepMode) {
+    sleepData.readings++;
+    deepSleepReadDone = true;
+  }
 }
 
 void publishSensorData() {
-  char JSONmessageBuffer[512];
-  DynamicJsonDocument doc(512);
+  JsonDocument& doc = sensorDoc;
+  doc.clear();
   if (pmsSensorOnline) {
     JsonObject airQualityJson = doc.createNestedObject(AQ_ASSET);
     airQualityJson["value"] = airQuality;
@@ -202,11 +382,17 @@ void publishSensorData() {
   }
   if (bmeSensorOnline) {
     JsonObject temperatureJson = doc.createNestedObject(TEMPERATURE_ASSET);
-    temperatureJson["value"] = avgTemperature;
+    setFixedValue(temperatureJson["value"], avgTemperature, 2);
     JsonObject humidityJson = doc.createNestedObject(HUMIDITY_ASSET);
-    humidityJson["value"] = avgHumidity;
+    setFixedValue(humidityJson["value"], avgHumidity, 2);
     JsonObject pressureJson = doc.createNestedObject(PRESSURE_ASSET);
-    pressureJson["value"] = avgPressure;
+    setFixedValue(pressureJson["value"], avgPressure, 2);
+    if (avgHumidity > 0) {
+      JsonObject dewPointJson = doc.createNestedObject(DEW_POINT_ASSET);
+      setFixedValue(dewPointJson["value"], dewPoint(avgTemperature, avgHumidity), 2);
+      JsonObject absHumidityJson = doc.createNestedObject(ABS_HUMIDITY_ASSET);
+      setFixedValue(absHumidityJson["value"], absoluteHumidity(avgTemperature, avgHumidity), 2);
+    }
   } else {
     Serial.println("[DATA] Won't send Temperature/Humidity/Pressure Sensor (BME280) data because it seems to be offline.");
   }
@@ -214,77 +400,267 @@ void publishSensorData() {
   firmwareJson["value"] = firmwareVersion;
   JsonObject wifiJson = doc.createNestedObject(WIFI_SIGNAL_ASSET);
   wifiJson["value"] = wifiSignal();
-  serializeJson(doc, JSONmessageBuffer);
 
+  if (!publishJson(doc, mqttSensorDataQos)) {
+    Serial.println("[DATA] Failed to send sensor data, keeping it for later.");
+    storeSensorData(); // Like when offline: the outbox gets the averages, batched readings stay for the next publish
+    return;
+  }
+  Serial.print("[DATA] Published sensor data to AllThingsTalk: ");
+  serializeJson(doc, Serial);
+  Serial.println();
+  if (dataBatchMode) {
+    publishSampleBatch(); // Whatever isn't sent stays for the next publish
+  }
+}
+
+void addSampleBatch(JsonDocument& doc, uint8_t count) { // Adds the oldest batched readings as [time, pm1, pm2.5, pm10, temperature, humidity, pressure], null where there's no data
+  JsonArray samplesJson = doc.createNestedObject(SAMPLES_ASSET).createNestedArray("value");
+  for (int i=0;i<count;i++) {
+    JsonArray sampleJson = samplesJson.createNestedArray();
+    if (dataBatch[i].timestamp != 0) {
+      sampleJson.add(dataBatch[i].timestamp);
+    } else {
+      sampleJson.addElement(); // null
+    }
+    addSampleValue(sampleJson, dataBatch[i].pm1, 0, dataBatch[i].flags & SensorOutbox::FLAG_PMS);
+    addSampleValue(sampleJson, dataBatch[i].pm25, 0, dataBatch[i].flags & SensorOutbox::FLAG_PMS);
+    addSampleValue(sampleJson, dataBatch[i].pm10, 0, dataBatch[i].flags & SensorOutbox::FLAG_PMS);
+    addSampleValue(sampleJson, dataBatch[i].temperature, 2, dataBatch[i].flags & SensorOutbox::FLAG_BME);
+    addSampleValue(sampleJson, dataBatch[i].humidity, 2, dataBatch[i].flags & SensorOutbox::FLAG_BME);
+    addSampleValue(sampleJson, dataBatch[i].pressure, 1, dataBatch[i].flags & SensorOutbox::FLAG_BME);
+  }
+}
+
+bool publishSampleBatch() { // Sends the batched readings in messages of up to dataBatchChunk, returns false if some are left
+  JsonDocument& doc = sensorDoc;
+  while (dataBatchCount > 0) {
+    uint8_t count = min(dataBatchCount, dataBatchChunk);
+    doc.clear();
+    addSampleBatch(doc, count);
+    if (!publishJson(doc, mqttSensorDataQos)) {
+      return false;
+    }
+    dataBatchCount -= count;
+    memmove(dataBatch, dataBatch + count, dataBatchCount * sizeof(dataBatch[0]));
+    Serial.print("[DATA] Published ");
+    Serial.print(count);
+    Serial.println(" readings to AllThingsTalk.");
+  }
+  return true;
+}
+
+bool publishJson(JsonDocument& doc, uint8_t qos) { // Serializes JSON (or MessagePack) straight into the MQTT connection, without a message buffer in between
   char topic[128];
   snprintf(topic, sizeof topic, "%s%s%s", "device/", deviceId, "/state");
-  mqtt.publish(topic, JSONmessageBuffer, false);
-  Serial.print("[DATA] Published sensor data to AllThingsTalk: ");
-  Serial.println(JSONmessageBuffer);
+  size_t length = dataMsgPack ? measureMsgPack(doc) : measureJson(doc);
+  if (!mqtt.beginPublish(topic, length, false, qos)) {
+    return false;
+  }
+  size_t written = dataMsgPack ? serializeMsgPack(doc, mqtt) : serializeJson(doc, mqtt);
+  if (dataMsgPack) {
+    Serial.print("[DATA] Sending ");
+    Serial.print(length);
+    Serial.print(" bytes as MessagePack (");
+    Serial.print(measureJson(doc));
+    Serial.println(" bytes as JSON)");
+  }
+  return mqtt.endPublish() && written == length;
 }
 
-void readPMS() { // Function that reads data from the PMS7003
-  while (pmsSerial.available()) { pmsSerial.read(); }
-  pms.requestRead(); // Now get the real data
-  
-  if (pms.readUntil(data)) {
-    int PM1 = data.PM_AE_UG_1_0;
-    int PM2_5 = data.PM_AE_UG_2_5;
-    int PM10 = data.PM_AE_UG_10_0;
-
-    avgPM1 = pm1.reading(PM1);
-    avgPM25 = pm25.reading(PM2_5);
-    avgPM10 = pm10.reading(PM10);
-
-    // Assign a text value of how good the air is based on current value
-    // http://www.amskv.sepa.gov.rs/kriterijumi.php
-    if (PM10 <= 20) {
-      airQualityRaw = "Excellent";
-    } else if (PM10 >= 21 && PM10 <= 40) {
-      airQualityRaw = "Good";
-    } else if (PM10 >= 41 && PM10 <= 50) {
-      airQualityRaw = "Acceptable";
-    } else if (PM10 >= 51 && PM10 <= 100) {
-      airQualityRaw = "Polluted";
-    } else if (PM10 > 100) {
-      airQualityRaw = "Very Polluted";
-    }
-
-    // Assign a text value of how good the air is based on average value
-    // http://www.amskv.sepa.gov.rs/kriterijumi.php
-    if (avgPM10 <= 20) {
-      airQuality = "Excellent";
-    } else if (avgPM10 >= 21 && avgPM10 <= 40) {
-      airQuality = "Good";
-    } else if (avgPM10 >= 41 && avgPM10 <= 50) {
-      airQuality = "Acceptable";
-    } else if (avgPM10 >= 51 && avgPM10 <= 100) {
-      airQuality = "Polluted";
-    } else if (avgPM10 > 100) {
-      airQuality = "Very Polluted";
-    }
-
-    // Print via SERIAL
-    Serial.print("Air Quality is ");
-    Serial.print(airQualityRaw);
-    Serial.print(" (Average: ");
-    Serial.print(airQuality);
-    Serial.println(")");
-    Serial.print("PM 1:          ");
-    Serial.print(PM1);
-    Serial.print(" µg/m³ (Average: ");
-    Serial.print(avgPM1);
-    Serial.println(")");
-    Serial.print("PM 2.5:        ");
-    Serial.print(PM2_5);
-    Serial.print(" µg/m³ (Average: ");
-    Serial.print(avgPM25);
-    Serial.println(")");
-    Serial.print("PM 10:         ");
-    Serial.print(PM10);
-    Serial.print(" µg/m³ (Average: ");
-    Serial.print(avgPM10);
-    Serial.println(")");
+void printMqttAckStats() { // Prints how sensor data publishes were confirmed by the broker
+  PubSubClient::ACK_STATS stats = mqtt.getAckStats();
+  Serial.print("[MQTT] Confirmed: ");
+  Serial.print(stats.acked);
+  Serial.print(", Resent: ");
+  Serial.print(stats.retransmitted);
+  Serial.print(", Lost: ");
+  Serial.print(stats.dropped);
+  Serial.print(", Waiting: ");
+  Serial.print(mqtt.getInflightCount());
+  if (stats.acked > 0) {
+    Serial.print(", Confirmation time (ms) min/avg/max: ");
+    Serial.print(stats.latencyMin);
+    Serial.print("/");
+    Serial.print(stats.latencySum / stats.acked);
+    Serial.print("/");
+    Serial.print(stats.latencyMax);
+  }
+  Serial.println();
+}
+
+void addSampleValue(JsonArray& sampleJson, int32_t value, uint8_t decimals, bool valid) { // Adds a fixed point value with the given number of decimals
+  if (!valid) {
+    sampleJson.addElement(); // null
+  } else if (decimals == 0) {
+    sampleJson.add(value);
+  } else {
+    setFixedValue(sampleJson.addElement(), value, decimals);
+  }
+}
+
+void setFixedValue(JsonVariant variant, int32_t value, uint8_t decimals) { // Exact text for JSON, a number for MessagePack (which can't carry raw text)
+  if (dataMsgPack) {
+    double scale = 1; // float would turn 23.45 into 23.450001
+    for (int i=0;i<decimals;i++) {
+      scale *= 10;
+    }
+    variant.set(value / scale);
+  } else {
+    char text[12];
+    variant.set(serialized(formatFixed(text, value, decimals)));
+  }
+}
+
+char* formatFixed(char* text, int32_t value, uint8_t decimals) { // Writes a fixed point value as a decimal number (2345 with 2 decimals is "23.45") without float math, text needs 12 characters
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : value;
+  uint32_t scale = 1;
+  for (int i=0;i<decimals;i++) {
+    scale *= 10;
+  }
+  if (decimals == 0) {
+    snprintf(text, 12, "%ld", (long)value);
+  } else {
+    snprintf(text, 12, "%s%lu.%0*lu", value < 0 ? "-" : "", (unsigned long)(magnitude / scale), decimals, (unsigned long)(magnitude % scale));
+  }
+  return text;
+}
+
+void batchSensorData(int32_t* readings) { // Keeps every reading of the interval for batch publishing
+  if (!dataBatchMode) {
+    return;
+  }
+  if (dataBatchCount >= sensorAverageSamplesMax && !wifiConnectionLost && !mqttConnectionLost) {
+    publishSampleBatch(); // More readings per publish than the batch holds, send them early
+  }
+  if (dataBatchCount >= sensorAverageSamplesMax) {
+    // Still full as there's no connection. The interval's averages are kept anyway, so only the newest readings are.
+    memmove(dataBatch, dataBatch + 1, (dataBatchCount - 1) * sizeof(dataBatch[0]));
+    dataBatchCount--;
+  }
+  fillSensorRecord(dataBatch[dataBatchCount++], readings[SENSOR_PM1], readings[SENSOR_PM2_5], readings[SENSOR_PM10],
+                   readings[SENSOR_TEMPERATURE], readings[SENSOR_HUMIDITY], readings[SENSOR_PRESSURE]);
+}
+
+void fillSensorRecord(SensorOutbox::RECORD& record, int32_t pm1, int32_t pm25, int32_t pm10, int32_t temperature, int32_t humidity, int32_t pressure) { // pm10 or temperature is SENSOR_MISSING if that sensor has no data
+  record = {};
+  record.timestamp = currentTime();
+  if (pm10 != SENSOR_MISSING) {
+    record.flags |= SensorOutbox::FLAG_PMS;
+    record.pm1 = pm1;
+    record.pm25 = pm25;
+    record.pm10 = pm10;
+  }
+  if (temperature != SENSOR_MISSING) {
+    record.flags |= SensorOutbox::FLAG_BME;
+    record.temperature = temperature;
+    record.humidity = humidity;
+    record.pressure = (pressure + 5) / 10; // 0.01 mbar to 0.1 mbar
+  }
+}
+
+void storeSensorData() { // Stores average sensor data in flash so it can be sent once connection is back
+  SensorOutbox::RECORD record;
+  fillSensorRecord(record, avgPM1, avgPM25, pmsSensorOnline ? avgPM10 : SENSOR_MISSING,
+                   bmeSensorOnline ? avgTemperature : SENSOR_MISSING, avgHumidity, avgPressure);
+  if (outbox.push(record)) {
+    Serial.print("[OUTBOX] Sensor data stored. Data points waiting to be sent: ");
+    Serial.println(outbox.available());
+  } else {
+    Serial.println("[OUTBOX] Sensor data couldn't be stored.");
+  }
+}
+
+bool publishStoredSensorData() { // Sends a batch of sensor data stored while there was no connection, returns false if nothing was sent or is waiting
+  if (!confirmStoredSensorData()) {
+    return true; // Previous batch isn't confirmed yet
+  }
+  SensorOutbox::RECORD records[outboxDrainBatch];
+  size_t count = outbox.peek(records, outboxDrainBatch);
+  size_t sent = 0;
+  while (sent < count && publishSensorRecord(records[sent])) {
+    sent++;
+  }
+  outboxPending = sent;
+  outboxPendingDropped = mqtt.getAckStats().dropped;
+  outboxPendingDrops = outbox.drops();
+  if (sent > 0) {
+    Serial.print("[OUTBOX] Sent ");
+    Serial.print(sent);
+    Serial.println(" stored data points, waiting for AllThingsTalk to confirm them.");
+  }
+  return sent > 0;
+}
+
+bool confirmStoredSensorData() { // Removes sent data points from flash once AllThingsTalk confirmed them, returns false while still waiting
+  if (outboxPending == 0) {
+    return true;
+  }
+  if (mqtt.getInflightCount() > 0) {
+    return false;
+  }
+  if (outbox.drops() != outboxPendingDrops) {
+    Serial.println("[OUTBOX] Sent data points were dropped to make room in the meantime, carrying on with the next ones.");
+  } else if (mqtt.getAckStats().dropped == outboxPendingDropped) {
+    outbox.pop(outboxPending);
+    Serial.print("[OUTBOX] ");
+    Serial.print(outboxPending);
+    Serial.print(" stored data points confirmed. Data points waiting to be sent: ");
+    Serial.println(outbox.available());
+  } else {
+    Serial.println("[OUTBOX] Some stored data points were lost on the way, sending them again.");
+  }
+  outboxPending = 0;
+  return true;
+}
+
+bool publishSensorRecord(const SensorOutbox::RECORD& record) { // Publishes one stored data point with the time it was taken
+  if (record.flags == 0) {
+    return true; // Nothing valid in it (e.g. damaged in flash), drop it
+  }
+  StaticJsonDocument<JSON_OBJECT_SIZE(9) + 9 * JSON_OBJECT_SIZE(2) + 24 + 5 * 8> doc; // Plus the copied time and text of 5 fixed point values
+  char at[24] = "";
+  if (record.timestamp) {
+    time_t timestamp = record.timestamp;
+    strftime(at, sizeof at, "%Y-%m-%dT%H:%M:%SZ", gmtime(&timestamp));
+  }
+  if (record.flags & SensorOutbox::FLAG_PMS) {
+    addStoredAsset(doc, AQ_ASSET, at)["value"] = airQualityFromPM10(record.pm10);
+    addStoredAsset(doc, PM1_ASSET, at)["value"] = record.pm1;
+    addStoredAsset(doc, PM2_5_ASSET, at)["value"] = record.pm25;
+    addStoredAsset(doc, PM10_ASSET, at)["value"] = record.pm10;
+  }
+  if (record.flags & SensorOutbox::FLAG_BME) {
+    setFixedValue(addStoredAsset(doc, TEMPERATURE_ASSET, at)["value"], record.temperature, 2);
+    setFixedValue(addStoredAsset(doc, HUMIDITY_ASSET, at)["value"], record.humidity, 2);
+    setFixedValue(addStoredAsset(doc, PRESSURE_ASSET, at)["value"], record.pressure, 1);
+    if (record.humidity > 0) {
+      setFixedValue(addStoredAsset(doc, DEW_POINT_ASSET, at)["value"], dewPoint(record.temperature, record.humidity), 2);
+      setFixedValue(addStoredAsset(doc, ABS_HUMIDITY_ASSET, at)["value"], absoluteHumidity(record.temperature, record.humidity), 2);
+    }
+  }
+  return publishJson(doc, mqttSensorDataQos);
+}
+
+JsonObject addStoredAsset(JsonDocument& doc, const char* asset, const char* at) {
+  JsonObject assetJson = doc.createNestedObject(asset);
+  if (at[0] != 0) {
+    assetJson["at"] = at; // When the data point was taken, otherwise AllThingsTalk uses the time it was received
+  }
+  return assetJson;
+}
+
+uint32_t currentTime() { // Unix time, or 0 if the clock hasn't been set over NTP yet
+  time_t now = time(nullptr);
+  return now > 1600000000 ? now : 0;
+}
+
+void readPMS(bool pmsDataReceived, int32_t* readings) { // Function that processes data received from the PMS7003
+  if (pmsDataReceived) {
+    readings[SENSOR_PM1]   = data.PM_AE_UG_1_0;
+    readings[SENSOR_PM2_5] = data.PM_AE_UG_2_5;
+    readings[SENSOR_PM10]  = data.PM_AE_UG_10_0;
+    airQualityRaw = airQualityFromPM10(data.PM_AE_UG_10_0); // Text value of how good the air is based on current value
 
     pmsSensorRetry = 0;
     if (!pmsSensorOnline) {
@@ -298,9 +674,9 @@ void readPMS() { // Function that reads data from the PMS7003
       if (pmsSensorRetry > sensorRetriesUntilConsideredOffline) {
         pmsSensorOnline = false;
         Serial.println("[PMS] Air Quality Sensor (PMS7003) seems to be offline!");
-        pm1.reset();
-        pm25.reset();
-        pm10.reset();
+        sensorAvg.resetChannel(SENSOR_PM1);
+        sensorAvg.resetChannel(SENSOR_PM2_5);
+        sensorAvg.resetChannel(SENSOR_PM10);
         initPMS();
       }
     } else {
@@ -310,42 +686,20 @@ void readPMS() { // Function that reads data from the PMS7003
   }
 }
 
-void readBME() { // Function for reading data from the BME280 Sensor
-  float temperatureRaw = bme.readTemperature();
-  float temperature    = temperatureRaw + bmeTemperatureOffset;
-  float humidityRaw    = bme.readHumidity();
-  float humidity       = humidityRaw * exp(243.12 * 17.62 * (temperatureRaw - temperature) / (243.12 + temperatureRaw) / (243.12 + temperature)); // Compensates the RH in accordance to temperature offset so the RH isn't wrong when the temp is offset
-  float pressure       = bme.readPressure() / 100.0F;
-
-  if (temperatureRaw > -100 && temperatureRaw < 150 && humidity >= 0 && humidity <= 100) {
-    avgTemperature = temp.reading(temperature*100);
-    avgTemperature = avgTemperature/100;
-    avgHumidity    = hum.reading(humidity*100);
-    avgHumidity    = avgHumidity/100;
-    avgPressure    = pres.reading(pressure*100);
-    avgPressure    = avgPressure/100;
+void readBME(int32_t* readings) { // Function for reading data from the BME280 Sensor
+  uint32_t pressureFixed = 0;
+  bool received        = bme.readAllFixed(&temperatureRaw, &pressureFixed, &humidityRaw); // All three from the same measurement, in one read
+  int32_t temperature  = temperatureRaw + bmeTemperatureOffsetFixed;
+  int32_t humidity     = -1;
+  int32_t pressure     = (pressureFixed + 128) >> 8; // Q24.8 Pa to Pa (0.01 mbar)
+  if (received && temperatureRaw > -10000 && temperatureRaw < 15000 && humidityRaw <= (100UL << 10)) { // Only a plausible reading goes through the correction
+    humidity = humidityAtTemperature((humidityRaw * 100 + 512) >> 10, temperatureRaw, temperature); // Q22.10 % to 0.01 %, then compensates the RH in accordance to temperature offset so the RH isn't wrong when the temp is offset
+  }
 
-    Serial.print("Temperature:   ");
-    Serial.print(temperature);
-    Serial.print("°C (Average: ");
-    Serial.print(avgTemperature);
-    Serial.print(", Raw: ");
-    Serial.print(temperatureRaw);
-    Serial.print(", Offset: ");
-    Serial.print(bmeTemperatureOffset);
-    Serial.println(")");
-    Serial.print("Humidity:      ");
-    Serial.print(humidity);
-    Serial.print(" % (Average: ");
-    Serial.print(avgHumidity);
-    Serial.print(", Raw: ");
-    Serial.print(humidityRaw);
-    Serial.println(")");
-    Serial.print("Pressure:      ");
-    Serial.print(pressure);
-    Serial.print(" mbar (Average: ");
-    Serial.print(avgPressure);
-    Serial.println(")");
+  if (humidity >= 0 && humidity <= 10000) {
+    readings[SENSOR_TEMPERATURE] = temperature;
+    readings[SENSOR_HUMIDITY]    = humidity;
+    readings[SENSOR_PRESSURE]    = pressure;
 
     bmeSensorRetry = 0;
     if (!bmeSensorOnline) {
@@ -359,9 +713,10 @@ void readBME() { // Function for reading data from the BME280 Sensor
       if (bmeSensorRetry > sensorRetriesUntilConsideredOffline) {
         bmeSensorOnline = false;
         Serial.println("[BME] Temperature/Humidity/Pressure Sensor (BME280) seems to be offline!");
-        temp.reset();
-        hum.reset();
-        pres.reset();
+        forgetBmeCalibration(); // It may come back as a different sensor
+        sensorAvg.resetChannel(SENSOR_TEMPERATURE);
+        sensorAvg.resetChannel(SENSOR_HUMIDITY);
+        sensorAvg.resetChannel(SENSOR_PRESSURE);
         initBME();
       }
     } else {
@@ -371,71 +726,162 @@ void readBME() { // Function for reading data from the BME280 Sensor
   }
 }
 
+void averageSensorData(int32_t* readings) { // Adds new readings of all sensors to the averaging window and updates averages
+  SensorAggregator<sensorChannels, sensorAverageSamplesMax>::STATS stats[sensorChannels];
+  sensorAvg.addRow(readings);
+  sensorAvg.getStats(stats);
+
+  if (stats[SENSOR_PM10].count > 0) {
+    avgPM1  = stats[SENSOR_PM1].mean;
+    avgPM25 = stats[SENSOR_PM2_5].mean;
+    avgPM10 = stats[SENSOR_PM10].mean;
+    airQuality = airQualityFromPM10(avgPM10); // Text value of how good the air is based on average value
+  }
+  if (stats[SENSOR_TEMPERATURE].count > 0) {
+    avgTemperature = stats[SENSOR_TEMPERATURE].mean;
+    avgHumidity    = stats[SENSOR_HUMIDITY].mean;
+    avgPressure    = stats[SENSOR_PRESSURE].mean;
+  }
+}
+
+const char* airQualityFromPM10(int pm10) { // Textual Air Quality Scale based on PM10 criteria (http://www.amskv.sepa.gov.rs/kriterijumi.php)
+  if (pm10 <= 20) {
+    return "Excellent";
+  } else if (pm10 <= 40) {
+    return "Good";
+  } else if (pm10 <= 50) {
+    return "Acceptable";
+  } else if (pm10 <= 100) {
+    return "Polluted";
+  }
+  return "Very Polluted";
+}
+
+void printPMS(int32_t* readings) {
+  Serial.print("Air Quality is ");
+  Serial.print(airQualityRaw);
+  Serial.print(" (Average: ");
+  Serial.print(airQuality);
+  Serial.println(")");
+  Serial.print("PM 1:          ");
+  Serial.print(readings[SENSOR_PM1]);
+  Serial.print(" µg/m³ (Average: ");
+  Serial.print(avgPM1);
+  Serial.println(")");
+  Serial.print("PM 2.5:        ");
+  Serial.print(readings[SENSOR_PM2_5]);
+  Serial.print(" µg/m³ (Average: ");
+  Serial.print(avgPM25);
+  Serial.println(")");
+  Serial.print("PM 10:         ");
+  Serial.print(readings[SENSOR_PM10]);
+  Serial.print(" µg/m³ (Average: ");
+  Serial.print(avgPM10);
+  Serial.println(")");
+}
+
+void printBME(int32_t* readings) {
+  char text[12];
+  Serial.print("Temperature:   ");
+  Serial.print(formatFixed(text, readings[SENSOR_TEMPERATURE], 2));
+  Serial.print("°C (Average: ");
+  Serial.print(formatFixed(text, avgTemperature, 2));
+  Serial.print(", Raw: ");
+  Serial.print(formatFixed(text, temperatureRaw, 2));
+  Serial.print(", Offset: ");
+  Serial.print(formatFixed(text, bmeTemperatureOffsetFixed, 2));
+  Serial.println(")");
+  Serial.print("Humidity:      ");
+  Serial.print(formatFixed(text, readings[SENSOR_HUMIDITY], 2));
+  Serial.print(" % (Average: ");
+  Serial.print(formatFixed(text, avgHumidity, 2));
+  Serial.print(", Raw: ");
+  Serial.print(formatFixed(text, (humidityRaw * 100 + 512) >> 10, 2));
+  Serial.println(")");
+  Serial.print("Pressure:      ");
+  Serial.print(formatFixed(text, readings[SENSOR_PRESSURE], 2));
+  Serial.print(" mbar (Average: ");
+  Serial.print(formatFixed(text, avgPressure, 2));
+  Serial.println(")");
+  if (readings[SENSOR_HUMIDITY] > 0 && avgHumidity > 0) {
+    Serial.print("Dew Point:     ");
+    Serial.print(formatFixed(text, dewPoint(readings[SENSOR_TEMPERATURE], readings[SENSOR_HUMIDITY]), 2));
+    Serial.print("°C (Average: ");
+    Serial.print(formatFixed(text, dewPoint(avgTemperature, avgHumidity), 2));
+    Serial.println(")");
+    Serial.print("Abs. Humidity: ");
+    Serial.print(formatFixed(text, absoluteHumidity(readings[SENSOR_TEMPERATURE], readings[SENSOR_HUMIDITY]), 2));
+    Serial.print(" g/m³ (Average: ");
+    Serial.print(formatFixed(text, absoluteHumidity(avgTemperature, avgHumidity), 2));
+    Serial.println(")");
+  }
+}
+
 void pmsPower(bool state) { // Controls sleep state of PMS sensor
   if (state) {
+    pmsSleepPending = false;
     pms.wakeUp();
     pms.passiveMode();
     pmsWoken = true;
   } else {
     pmsSerial.flush();
-    unsigned long now = millis();
-    while(millis() < now + 100);
     pmsWoken = false;
+    pmsSleepPending = true;
+    if (scheduler.after(pmsSleepDelay, pmsSleepTask) == taskScheduler::NO_TASK) { // Sleep command goes out once PMS7003 has had time to finish
+      pmsSleepTask(0); // No room to schedule it, better asleep a bit early than running until the next reading
+    }
+  }
+}
+
+void pmsSleepTask(uint8_t) {
+  if (pmsSleepPending) { // Unless it was woken up again in the meantime
+    pmsSleepPending = false;
     pms.sleep();
   }
 }
  
 void changeInterval(int interval) { // Changes sensor data reporting interval
-  if (interval > 5 && interval <= 60) {
-    dataPublishInterval = interval;
-    pmsNoSleep = false;
-    Serial.print("[DATA] Device reporting interval set to ");
-    Serial.print(interval);
-    Serial.println(" minutes");
-    Serial.print("[DATA] Sensor data will be read every ");
-    Serial.print(readIntervalSeconds());
-    Serial.println(" seconds for averaging.");
-    publishDiagnosticData();
-  } else if (interval <= 1) {
-    dataPublishInterval = 1;
-    pmsNoSleep = true;
-    pmsPower(true);
-    Serial.println("[DATA] Reporting interval set to 1 minute (minimum).");
-    Serial.print("[DATA] Sensor data will be read every ");
-    Serial.print(readIntervalSeconds());
-    Serial.println(" seconds for averaging.");
-    Serial.println("[DATA] This prevents sleeping of Air Quality Sensor and reduces its lifespan.");
-    publishDiagnosticData();
-  } else if (interval <= 5) {
-    dataPublishInterval = interval;
-    pmsNoSleep = true;
+  if (interval < 1) {
+    interval = 1;
+  } else if (interval > 60) {
+    interval = 60;
+  }
+  dataPublishInterval = interval;
+  Serial.print("[DATA] Device reporting interval set to ");
+  Serial.print(dataPublishInterval);
+  Serial.println(" minutes");
+  updateSchedule();
+  publishDiagnosticData();
+}
+
+void updateSchedule() { // Decides if PMS7003 can sleep between readings and reports how much of the time it runs
+  int period = readIntervalSeconds();
+  bool noSleep = period - pmsWakeBefore < pmsMinSleep;
+  if (noSleep && !pmsNoSleep) {
     pmsPower(true);
-    Serial.print("[DATA] Device reporting interval set to ");
-    Serial.print(interval);
-    Serial.println(" minutes");
-    Serial.print("[DATA] Sensor data will be read every ");
-    Serial.print(readIntervalSeconds());
-    Serial.println(" seconds for averaging.");
-    Serial.println("[DATA] This prevents sleeping of Air Quality Sensor and reduces its lifespan.");
-    publishDiagnosticData();
-  } else if (interval >= 60) {
-    dataPublishInterval = 60;
-    pmsNoSleep = false;
-    Serial.print("[DATA] Device reporting interval set to ");
-    Serial.print(dataPublishInterval);
-    Serial.println(" minutes");
-    Serial.print("[DATA] Sensor data will be read every ");
-    Serial.print(readIntervalSeconds());
-    Serial.println(" seconds for averaging.");
-    publishDiagnosticData();
+  }
+  pmsNoSleep = noSleep;
+
+  Serial.print("[DATA] Sensor data will be read every ");
+  Serial.print(period);
+  Serial.print(" seconds, averaging the last ");
+  Serial.print(sensorAverageSamples);
+  Serial.println(" readings.");
+  float dutyCycle = pmsNoSleep ? 1 : (float)pmsWakeBefore / period;
+  Serial.print("[PMS] Air Quality Sensor runs ");
+  Serial.print(dutyCycle * 100, 0);
+  Serial.print("% of the time, its fan should last about ");
+  Serial.print(pmsFanLifetime / dutyCycle / 8760, 1);
+  Serial.println(" years.");
+  if (pmsNoSleep) {
+    Serial.println("[PMS] Readings are too close together for the Air Quality Sensor to sleep. This reduces its lifespan.");
   }
 }
 
 void publishDiagnosticData() { // Publishes diagnostic data to AllThingsTalk
   if (!wifiConnectionLost) {
     if (!mqttConnectionLost) {
-      char JSONmessageBuffer[256];
-      DynamicJsonDocument doc(256);
+      StaticJsonDocument<JSON_OBJECT_SIZE(8) + 8 * JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(4) + 32> doc; // 8 assets, plus room for firmware version and WiFi signal strings
       JsonObject dataPublishIntervalJson = doc.createNestedObject(INTERVAL_ASSET);
       dataPublishIntervalJson["value"] = dataPublishInterval;
       JsonObject firmwareJson = doc.createNestedObject(FIRMWARE_ASSET);
@@ -444,13 +890,22 @@ void publishDiagnosticData() { // Publishes diagnostic data to AllThingsTalk
       wifiJson["value"] = wifiSignal();
       JsonObject tempOffsetJson = doc.createNestedObject(TEMP_OFFSET_ASSET);
       tempOffsetJson["value"] = bmeTemperatureOffset;
-      serializeJson(doc, JSONmessageBuffer);
-    
-      char topic[256];
-      snprintf(topic, sizeof topic, "%s%s%s", "device/", deviceId, "/state");
-      mqtt.publish(topic, JSONmessageBuffer, false);
+      JsonObject sampleCountJson = doc.createNestedObject(SAMPLE_COUNT_ASSET);
+      sampleCountJson["value"] = sensorAverageSamples;
+      JsonObject samplePeriodJson = doc.createNestedObject(SAMPLE_PERIOD_ASSET);
+      samplePeriodJson["value"] = sensorSamplePeriod;
+      JsonObject pmsWakeJson = doc.createNestedObject(PMS_WAKE_ASSET);
+      pmsWakeJson["value"] = pmsWakeBefore;
+      JsonObject reconnectsJson = doc.createNestedObject(RECONNECTS_ASSET).createNestedObject("value");
+      reconnectsJson["wifi-attempts"] = wifiReconnect.getAttempts();
+      reconnectsJson["wifi-reconnects"] = wifiReconnect.getSuccesses();
+      reconnectsJson["mqtt-attempts"] = mqttReconnect.getAttempts();
+      reconnectsJson["mqtt-reconnects"] = mqttReconnect.getSuccesses();
+      publishJson(doc, 0);
       Serial.print("[DATA] Published diagnostic data to AllThingsTalk: ");
-      Serial.println(JSONmessageBuffer);
+      serializeJson(doc, Serial);
+      Serial.println();
+      printMqttAckStats();
     } else {
       Serial.println("[DATA] Can't send diagnostic data because Klimerko is not connected to AllThingsTalk");
     }
@@ -459,14 +914,74 @@ void publishDiagnosticData() { // Publishes diagnostic data to AllThingsTalk
   }
 }
 
+void publishLoopTimingData() { // Publishes min/avg/max/p99 duration (microseconds) of every loop stage since last publish
+  StaticJsonDocument<2 * JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(loopStageCount) + loopStageCount * JSON_ARRAY_SIZE(4)> doc;
+  JsonObject loopTimingJson = doc.createNestedObject(LOOP_TIMING_ASSET).createNestedObject("value");
+  for (int i=0;i<loopStageCount;i++) {
+    JsonArray stageJson = loopTimingJson.createNestedArray(loopStageNames[i]);
+    stageJson.add(loopTimings[i].getMin());
+    stageJson.add(loopTimings[i].getAvg());
+    stageJson.add(loopTimings[i].getMax());
+    stageJson.add(loopTimings[i].getPercentile(99));
+  }
+  if (!publishJson(doc, 0)) {
+    Serial.println("[DATA] Failed to send loop timing data, keeping it for the next publish.");
+    return;
+  }
+  Serial.print("[DATA] Published loop timing data to AllThingsTalk: ");
+  serializeJson(doc, Serial);
+  Serial.println();
+
+  for (int i=0;i<loopStageCount;i++) {
+    loopTimings[i].reset();
+  }
+}
+
+void printLoopTiming() {
+  Serial.print("Loop Time:     ");
+  Serial.print(loopTimings[LOOP_STAGE_TOTAL].getAvg());
+  Serial.print(" µs (Max: ");
+  Serial.print(loopTimings[LOOP_STAGE_TOTAL].getMax());
+  Serial.print(", 99%: ");
+  Serial.print(loopTimings[LOOP_STAGE_TOTAL].getPercentile(99));
+  Serial.println(")");
+  if (loopTimingSerialDump) {
+    for (int i=0;i<loopStageCount;i++) {
+      Serial.print("  ");
+      Serial.print(loopStageNames[i]);
+      Serial.print(": min ");
+      Serial.print(loopTimings[i].getMin());
+      Serial.print(", avg ");
+      Serial.print(loopTimings[i].getAvg());
+      Serial.print(", max ");
+      Serial.print(loopTimings[i].getMax());
+      Serial.print(", 99% ");
+      Serial.print(loopTimings[i].getPercentile(99));
+      Serial.print(" µs (");
+      Serial.print(loopTimings[i].getCount());
+      Serial.print(" runs");
+      if (i < LOOP_STAGE_TOTAL) {
+        Serial.print(", ");
+        Serial.print(scheduler.getRunCount(loopStageTasks[i]));
+        Serial.print(" scheduled, ");
+        Serial.print(scheduler.getOverruns(loopStageTasks[i]));
+        Serial.print(" overruns");
+      }
+      Serial.println(")");
+    }
+  }
+}
+
 unsigned long readIntervalMillis() {
+  if (sensorSamplePeriod > 0) {
+    return sensorSamplePeriod * 1000UL;
+  }
   unsigned long result = (dataPublishInterval * 60000) / sensorAverageSamples;
   return result;
 }
 
 int readIntervalSeconds() {
-  int result = (dataPublishInterval * 60) / sensorAverageSamples;
-  return result;
+  return readIntervalMillis() / 1000;
 }
 
 void restoreData() { // Restores AllThingsTalk credentials from EEPROM as well as temperature offset data
@@ -497,6 +1012,7 @@ void restoreData() { // Restores AllThingsTalk credentials from EEPROM as well a
     portalTemperatureOffset.setValue(bmeTemperatureOffsetChar, sizeof(bmeTemperatureOffsetChar));
   } else {
     bmeTemperatureOffset = atof(bmeTemperatureOffsetChar); // Store the char that was in memory as a double (lazy)
+    bmeTemperatureOffsetFixed = round(bmeTemperatureOffset * 100);
     portalTemperatureOffset.setValue(bmeTemperatureOffsetChar, sizeof(bmeTemperatureOffsetChar)); // Update the value on WiFi Configuration Portal
     Serial.print("[MEMORY] Temperature Offset: ");
     Serial.print(bmeTemperatureOffsetChar);
@@ -504,6 +1020,102 @@ void restoreData() { // Restores AllThingsTalk credentials from EEPROM as well a
     Serial.print(bmeTemperatureOffset);
     Serial.println("°C)");
   }
+  restoreSettings();
+  restoreWiFiCache();
+}
+
+void restoreSettings() { // Restores settings changed over MQTT, keeping defaults for anything missing or out of range
+  uint8_t samples, wakeBefore;
+  uint16_t samplePeriod;
+  char okSettings[2+1];
+  EEPROM.begin(EEPROMsize);
+  EEPROM.get(EEPROM_settingsAddress, samples);
+  EEPROM.get(EEPROM_settingsAddress+sizeof(samples), wakeBefore);
+  EEPROM.get(EEPROM_settingsAddress+sizeof(samples)+sizeof(wakeBefore), samplePeriod);
+  EEPROM.get(EEPROM_settingsAddress+sizeof(samples)+sizeof(wakeBefore)+sizeof(samplePeriod), okSettings);
+  EEPROM.end();
+  if (String(okSettings) != String("OK")) {
+    Serial.println("[MEMORY] Settings: Nothing in Memory. Using defaults.");
+    sensorAvg.setWindow(sensorAverageSamples);
+    updateSchedule();
+    return;
+  }
+  if (samples >= sensorAverageSamplesMin && samples <= sensorAverageSamplesMax) {
+    sensorAverageSamples = samples;
+  }
+  sensorAvg.setWindow(sensorAverageSamples);
+  if (wakeBefore >= pmsWakeBeforeMin && wakeBefore <= pmsWakeBeforeMax) {
+    pmsWakeBefore = wakeBefore;
+  }
+  if (samplePeriod == 0 || (samplePeriod >= sensorSamplePeriodMin && samplePeriod <= sensorSamplePeriodMax)) {
+    sensorSamplePeriod = samplePeriod;
+  }
+  Serial.print("[MEMORY] Samples per interval: ");
+  Serial.print(sensorAverageSamples);
+  Serial.print(", Air Quality Sensor wakes ");
+  Serial.print(pmsWakeBefore);
+  Serial.println(" seconds before reading.");
+  updateSchedule();
+}
+
+bool saveSettings() { // Saves settings changed over MQTT
+  char ok[2+1] = "OK";
+  EEPROM.begin(EEPROMsize);
+  EEPROM.put(EEPROM_settingsAddress, sensorAverageSamples);
+  EEPROM.put(EEPROM_settingsAddress+sizeof(sensorAverageSamples), pmsWakeBefore);
+  EEPROM.put(EEPROM_settingsAddress+sizeof(sensorAverageSamples)+sizeof(pmsWakeBefore), sensorSamplePeriod);
+  EEPROM.put(EEPROM_settingsAddress+sizeof(sensorAverageSamples)+sizeof(pmsWakeBefore)+sizeof(sensorSamplePeriod), ok);
+  bool saved = EEPROM.commit();
+  EEPROM.end();
+  Serial.println(saved ? "[MEMORY] Settings saved." : "[MEMORY] Settings couldn't be saved to memory.");
+  return saved;
+}
+
+void restoreWiFiCache() { // Restores channel, BSSID and IP lease of the last WiFi connection
+  char okCache[2+1];
+  EEPROM.begin(EEPROMsize);
+  EEPROM.get(EEPROM_wifiCacheAddress, wifiCacheChannel);
+  EEPROM.get(EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel), wifiCacheBssid);
+  EEPROM.get(EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel)+sizeof(wifiCacheBssid), wifiCacheAddresses);
+  EEPROM.get(EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel)+sizeof(wifiCacheBssid)+sizeof(wifiCacheAddresses), okCache);
+  EEPROM.end();
+  wifiCacheValid = String(okCache) == String("OK") && wifiCacheChannel >= 1 && wifiCacheChannel <= 14 && wifiCacheAddresses[0] != 0;
+}
+
+void saveWiFiCache() { // Saves channel, BSSID and IP lease of the current WiFi connection, only if they changed to spare the flash
+  uint32_t addresses[4] = { WiFi.localIP(), WiFi.gatewayIP(), WiFi.subnetMask(), WiFi.dnsIP() };
+  uint8_t channel = WiFi.channel();
+  uint8_t* bssid = WiFi.BSSID();
+  if (bssid == NULL || (wifiCacheValid && channel == wifiCacheChannel && memcmp(bssid, wifiCacheBssid, sizeof(wifiCacheBssid)) == 0
+      && memcmp(addresses, wifiCacheAddresses, sizeof(wifiCacheAddresses)) == 0)) {
+    return;
+  }
+  wifiCacheChannel = channel;
+  memcpy(wifiCacheBssid, bssid, sizeof(wifiCacheBssid));
+  memcpy(wifiCacheAddresses, addresses, sizeof(wifiCacheAddresses));
+  char ok[2+1] = "OK";
+  EEPROM.begin(EEPROMsize);
+  EEPROM.put(EEPROM_wifiCacheAddress, wifiCacheChannel);
+  EEPROM.put(EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel), wifiCacheBssid);
+  EEPROM.put(EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel)+sizeof(wifiCacheBssid), wifiCacheAddresses);
+  EEPROM.put(EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel)+sizeof(wifiCacheBssid)+sizeof(wifiCacheAddresses), ok);
+  wifiCacheValid = EEPROM.commit();
+  EEPROM.end();
+  if (wifiCacheValid) {
+    Serial.print("[MEMORY] WiFi connection saved for fast reconnect. Channel: ");
+    Serial.println(wifiCacheChannel);
+  }
+}
+
+bool saveTemperatureOffset() { // Saves temperature offset set over MQTT
+  char ok[2+1] = "OK";
+  EEPROM.begin(EEPROMsize);
+  EEPROM.put(EEPROM_attStartAddress+sizeof(deviceId)+sizeof(deviceToken)+sizeof(ok), bmeTemperatureOffsetChar);
+  EEPROM.put(EEPROM_attStartAddress+sizeof(deviceId)+sizeof(deviceToken)+sizeof(ok)+sizeof(bmeTemperatureOffsetChar), ok);
+  bool saved = EEPROM.commit();
+  EEPROM.end();
+  Serial.println(saved ? "[MEMORY] Temperature Offset saved." : "[MEMORY] Temperature Offset couldn't be saved to memory.");
+  return saved;
 }
 
 void saveData() { // Saves new ATT credentials in memory and connects to AllThingsTalk
@@ -572,14 +1184,15 @@ void saveData() { // Saves new ATT credentials in memory and connects to AllThin
     sprintf(bmeTemperatureOffsetChar, "%s", portalTemperatureOffset.getValue()); // Convert const char* to char array for saving in memory
     portalTemperatureOffset.setValue(bmeTemperatureOffsetChar, sizeof(bmeTemperatureOffsetChar)); // Set WiFi Configuration Portal to show the real value of offset
     bmeTemperatureOffset = atof(bmeTemperatureOffsetChar); // Convert the entered value to double (even though the variable is a float - I know, I know...)
+    bmeTemperatureOffsetFixed = round(bmeTemperatureOffset * 100);
     Serial.print("[MEMORY] Saving Temperature Offset: ");
     Serial.print(bmeTemperatureOffsetChar);
     Serial.print("°C (Float: ");
     Serial.print(bmeTemperatureOffset);
     Serial.println("°C)");
     // Reset average temperature and humidity values in case the offset was changed during device operation since already-existing averaging data would be wrong due to new temperature offset.
-    temp.reset();
-    hum.reset();
+    sensorAvg.resetChannel(SENSOR_TEMPERATURE);
+    sensorAvg.resetChannel(SENSOR_HUMIDITY);
     tempOffsetCanBeSaved = true;
   }
 
@@ -640,8 +1253,10 @@ void factoryReset() { // Deletes WiFi and AllThingsTalk credentials and reboots
   }
   wm.resetSettings();
   ESP.eraseConfig();
+  outbox.clear();
+  outboxPending = 0;
   EEPROM.begin(EEPROMsize);
-  for (int i=EEPROM_attStartAddress; i <= sizeof(deviceId)+sizeof(deviceToken)+3+sizeof(bmeTemperatureOffsetChar)+3; i++) {
+  for (int i=EEPROM_attStartAddress; i < EEPROM_wifiCacheAddress+sizeof(wifiCacheChannel)+sizeof(wifiCacheBssid)+sizeof(wifiCacheAddresses)+3; i++) {
     EEPROM.write(i, 0);
   }
   EEPROM.commit();
@@ -754,37 +1369,177 @@ void ledLoop() { // Handles status LED
   }
 }
 
-String extractAssetNameFromTopic(String topic) {
-  const int devicePrefixLength = 38;
-  const int stateSuffixLength = 8;
-  return topic.substring(devicePrefixLength, topic.length()-stateSuffixLength);
+const char* assetNameFromTopic(const char* topic, size_t* length) { // Finds the asset name in "device/<id>/asset/<name>/command" without copying it
+  const char* name = strstr(topic, "/asset/");
+  if (name == NULL) {
+    return NULL;
+  }
+  name += strlen("/asset/");
+  const char* end = strchr(name, '/');
+  *length = end ? end - name : strlen(name);
+  return name;
+}
+
+void intervalCommand(JsonVariantConst value) {
+  changeInterval(value.as<int>());
+}
+
+void temperatureOffsetCommand(JsonVariantConst value) {
+  float offset = value.as<float>();
+  if (!value.is<float>() || offset > bmeTemperatureOffsetMax || offset < bmeTemperatureOffsetMin) {
+    Serial.print("[COMMAND] Won't set Temperature Offset because it's not a number between ");
+    Serial.print(bmeTemperatureOffsetMin);
+    Serial.print(" and ");
+    Serial.println(bmeTemperatureOffsetMax);
+  } else if (offset != bmeTemperatureOffset) {
+    snprintf(bmeTemperatureOffsetChar, sizeof(bmeTemperatureOffsetChar), "%.2f", offset);
+    bmeTemperatureOffset = atof(bmeTemperatureOffsetChar);
+    bmeTemperatureOffsetFixed = round(bmeTemperatureOffset * 100);
+    portalTemperatureOffset.setValue(bmeTemperatureOffsetChar, sizeof(bmeTemperatureOffsetChar));
+    // Averages taken with the old offset would be wrong
+    sensorAvg.resetChannel(SENSOR_TEMPERATURE);
+    sensorAvg.resetChannel(SENSOR_HUMIDITY);
+    Serial.print("[COMMAND] Temperature Offset set to ");
+    Serial.print(bmeTemperatureOffset);
+    Serial.println("°C");
+    saveTemperatureOffset();
+  }
+  acknowledgeCommand(TEMP_OFFSET_ASSET, bmeTemperatureOffset);
+}
+
+void sampleCountCommand(JsonVariantConst value) {
+  int samples = value.as<int>();
+  if (!value.is<int>() || samples < sensorAverageSamplesMin || samples > sensorAverageSamplesMax) {
+    Serial.print("[COMMAND] Won't set sample count because it's not a number between ");
+    Serial.print(sensorAverageSamplesMin);
+    Serial.print(" and ");
+    Serial.println(sensorAverageSamplesMax);
+  } else if (samples != sensorAverageSamples) {
+    sensorAverageSamples = samples;
+    sensorAvg.setWindow(sensorAverageSamples);
+    Serial.print("[COMMAND] Sensor data will now be averaged over ");
+    Serial.print(sensorAverageSamples);
+    Serial.println(" readings.");
+    updateSchedule();
+    saveSettings();
+  }
+  acknowledgeCommand(SAMPLE_COUNT_ASSET, sensorAverageSamples);
+}
+
+void pmsWakeCommand(JsonVariantConst value) {
+  int wakeBefore = value.as<int>();
+  if (!value.is<int>() || wakeBefore < pmsWakeBeforeMin || wakeBefore > pmsWakeBeforeMax) {
+    Serial.print("[COMMAND] Won't set Air Quality Sensor wake time because it's not a number between ");
+    Serial.print(pmsWakeBeforeMin);
+    Serial.print(" and ");
+    Serial.println(pmsWakeBeforeMax);
+  } else if (wakeBefore != pmsWakeBefore) {
+    pmsWakeBefore = wakeBefore;
+    Serial.print("[COMMAND] Air Quality Sensor will now wake up ");
+    Serial.print(pmsWakeBefore);
+    Serial.println(" seconds before reading.");
+    updateSchedule();
+    saveSettings();
+  }
+  acknowledgeCommand(PMS_WAKE_ASSET, pmsWakeBefore);
+}
+
+void samplePeriodCommand(JsonVariantConst value) {
+  int period = value.as<int>();
+  if (!value.is<int>() || (period != 0 && (period < sensorSamplePeriodMin || period > sensorSamplePeriodMax))) {
+    Serial.print("[COMMAND] Won't set sample period because it's not 0 or a number between ");
+    Serial.print(sensorSamplePeriodMin);
+    Serial.print(" and ");
+    Serial.println(sensorSamplePeriodMax);
+  } else if (period != sensorSamplePeriod) {
+    sensorSamplePeriod = period;
+    if (sensorSamplePeriod == 0) {
+      Serial.println("[COMMAND] Sensor readings will be spread over the reporting interval.");
+    }
+    updateSchedule();
+    saveSettings();
+  }
+  acknowledgeCommand(SAMPLE_PERIOD_ASSET, sensorSamplePeriod);
+}
+
+void publishNowCommand(JsonVariantConst value) {
+  Serial.println("[COMMAND] Sending sensor data now.");
+  dataPublishNow = true;
+  acknowledgeCommand(PUBLISH_NOW_ASSET, true);
 }
 
+void rebootCommand(JsonVariantConst value) {
+  if (!value.as<bool>()) {
+    return;
+  }
+  acknowledgeCommand(REBOOT_ASSET, true);
+  Serial.println("[COMMAND] Rebooting.");
+  mqtt.disconnect();
+  delay(100);
+  ESP.restart();
+}
+
+void acknowledgeCommand(const char* asset, float value) { // Reports the value a command left the asset with on the state topic
+  StaticJsonDocument<2 * JSON_OBJECT_SIZE(1)> doc;
+  doc.createNestedObject(asset)["value"] = value;
+  publishJson(doc, 0);
+}
+
+void acknowledgeCommand(const char* asset, int value) {
+  StaticJsonDocument<2 * JSON_OBJECT_SIZE(1)> doc;
+  doc.createNestedObject(asset)["value"] = value;
+  publishJson(doc, 0);
+}
+
+void acknowledgeCommand(const char* asset, bool value) {
+  StaticJsonDocument<2 * JSON_OBJECT_SIZE(1)> doc;
+  doc.createNestedObject(asset)["value"] = value;
+  publishJson(doc, 0);
+}
+
+// Commands from AllThingsTalk, by asset name. Handlers get the "value" of the command.
+typedef void (*commandHandler)(JsonVariantConst value);
+struct command {
+  const char*    asset;
+  commandHandler handler;
+};
+const command commands[] = {
+  { INTERVAL_ASSET,     intervalCommand },
+  { TEMP_OFFSET_ASSET,  temperatureOffsetCommand },
+  { SAMPLE_COUNT_ASSET, sampleCountCommand },
+  { SAMPLE_PERIOD_ASSET, samplePeriodCommand },
+  { PMS_WAKE_ASSET,     pmsWakeCommand },
+  { PUBLISH_NOW_ASSET,  publishNowCommand },
+  { REBOOT_ASSET,       rebootCommand },
+};
+
 void mqttCallback(char* p_topic, byte* p_payload, unsigned int p_length) {
   Serial.println("[MQTT] Message Received from AllThingsTalk");
-  String topic(p_topic);
-  
-  // Deserialize JSON
-  DynamicJsonDocument doc(256);
-  char json[256];
-  for (int i = 0; i < p_length; i++) {
-      json[i] = (char)p_payload[i];
+
+  size_t assetLength;
+  const char* asset = assetNameFromTopic(p_topic, &assetLength);
+  if (asset == NULL) {
+    return;
   }
-  auto error = deserializeJson(doc, json);
+
+  // Deserialize JSON in place, strings in the document point into the payload
+  StaticJsonDocument<JSON_OBJECT_SIZE(4)> doc;
+  auto error = deserializeJson(doc, p_payload, p_length);
   if (error) {
       Serial.print("[MQTT] Parsing JSON failed. Code: ");
       Serial.println(error.c_str());
       return;
   }
 
-  String asset = extractAssetNameFromTopic(topic);
-//  Serial.print("[MQTT] Asset Name: ");
-//  Serial.println(asset);
-
-  if (asset == INTERVAL_ASSET) {
-    int value = doc["value"];
-    changeInterval(value);
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+    if (strlen(commands[i].asset) == assetLength && strncmp(commands[i].asset, asset, assetLength) == 0) {
+      commands[i].handler(doc["value"]);
+      return;
+    }
   }
+  Serial.print("[MQTT] Unknown command: ");
+  Serial.write((const uint8_t*)asset, assetLength);
+  Serial.println();
 }
 
 String wifiSignal() {
@@ -814,12 +1569,58 @@ void initPMS() {
   pmsPower(true);
 }
 
-void initBME() {
-  bme.begin(0x76);
+void initBME() { // BME280 sleeps between readings in forced mode, readSensorData() wakes it for one measurement
+  unsigned long start = millis();
+  bool restored = bme.getCalibration(&bmeCalibration.calibration) || restoreBmeCalibration();
+  bool found = bme.begin(0x76);
+  if (found && restored && !bme.verifyCalibration()) {
+    forgetBmeCalibration(); // Not the sensor the coefficients are from
+    restored = false;
+    found = bme.begin(0x76);
+  }
+  if (!found) {
+    return;
+  }
+  if (!restored) {
+    saveBmeCalibration();
+  }
+  Serial.print("[BME] Ready in ");
+  Serial.print(millis() - start);
+  Serial.println(restored ? " ms, calibration kept from before." : " ms, calibration read from sensor.");
+  const bmeSettings& profile = bmeProfiles[bmeProfile];
+  bme.setSampling(Adafruit_BME280::MODE_FORCED, profile.temperature, profile.pressure, profile.humidity, profile.filter);
+  Serial.print("[BME] Profile: ");
+  Serial.print(profile.name);
+  Serial.print(", measurement takes up to ");
+  Serial.print(bme.getMeasurementTime());
+  Serial.println(" us.");
+}
+
+bool restoreBmeCalibration() { // Hands BME280 coefficients kept in RTC memory to the library, returns false if there were none
+  ESP.rtcUserMemoryRead(bmeCalibrationBlock, (uint32_t*)&bmeCalibration, sizeof(bmeCalibration));
+  if (bmeCalibration.crc != memoryCrc((const uint8_t*)&bmeCalibration + sizeof(bmeCalibration.crc), sizeof(bmeCalibration) - sizeof(bmeCalibration.crc))) {
+    return false;
+  }
+  bme.setCalibration(&bmeCalibration.calibration);
+  return true;
+}
+
+void saveBmeCalibration() { // Keeps BME280 coefficients in RTC memory, which survives reboots and deep sleep but not power loss
+  bme.getCalibration(&bmeCalibration.calibration);
+  bmeCalibration.crc = memoryCrc((const uint8_t*)&bmeCalibration + sizeof(bmeCalibration.crc), sizeof(bmeCalibration) - sizeof(bmeCalibration.crc));
+  ESP.rtcUserMemoryWrite(bmeCalibrationBlock, (uint32_t*)&bmeCalibration, sizeof(bmeCalibration));
+}
+
+void forgetBmeCalibration() {
+  bme.clearCalibration();
+  bmeCalibration.crc = 0;
+  ESP.rtcUserMemoryWrite(bmeCalibrationBlock, (uint32_t*)&bmeCalibration, sizeof(bmeCalibration));
 }
 
 void generateID() {
   snprintf(klimerkoID, sizeof(klimerkoID), "%s%i", "KLIMERKO-", ESP.getChipId());
+  wifiReconnect.seed(ESP.getChipId()); // Every Klimerko retries at its own times
+  mqttReconnect.seed(ESP.getChipId() ^ 0x9E3779B9);
   Serial.print("[ID] Unique Klimerko ID: ");
   Serial.println(klimerkoID);
 }
@@ -830,34 +1631,43 @@ void mqttSubscribeTopics() {
   mqtt.subscribe(command_topic);
 }
 
-bool connectMQTT() {
+bool connectMQTT() { // Starts connecting to AllThingsTalk, maintainMQTT() takes it from there so the loop isn't blocked
   if (!wifiConnectionLost) {
-    Serial.print("[MQTT] Connecting to AllThingsTalk... ");
-    if (mqtt.connect(klimerkoID, deviceToken, MQTT_PASSWORD)) {
-      Serial.println("Connected!");
-      if (mqttConnectionLost) {
-        mqttConnectionLost = false;
-        ledSuccessBlink = true;
-      }
-      mqttSubscribeTopics();
-      publishDiagnosticData();
-      return true;
-    } else {
-      Serial.print("Failed! Reason: ");
-      Serial.println(mqtt.state());
-      mqttConnectionLost = true;
-      return false;
-    }
+    Serial.println("[MQTT] Connecting to AllThingsTalk...");
+    mqttConnecting = mqtt.beginConnect(klimerkoID, deviceToken, MQTT_PASSWORD);
+    return mqttConnecting;
   }
   return false;
 }
 
 void maintainMQTT() {
   mqtt.loop();
+  if (mqtt.connecting()) {
+    return;
+  }
+  if (mqttConnecting) {
+    mqttConnecting = false;
+    if (mqtt.connected()) {
+      Serial.println("[MQTT] Connected to AllThingsTalk!");
+      mqttReconnect.success();
+      ledSuccessBlink = true;
+      mqttSubscribeTopics();
+    } else {
+      Serial.print("[MQTT] Connecting to AllThingsTalk failed! Reason: ");
+      Serial.println(mqtt.state());
+      mqttConnectionLost = true;
+    }
+  }
   if (mqtt.connected()) {
     if (mqttConnectionLost) {
       mqttConnectionLost = false;
       publishDiagnosticData();
+      if (!wifiOfflineTimed) {
+        wifiOfflineTimed = true;
+        Serial.print(wifiLostSince == 0 ? "[WiFi] First publish " : "[WiFi] Published again ");
+        Serial.print(millis() - wifiLostSince);
+        Serial.println(wifiLostSince == 0 ? " ms after boot." : " ms after connection was lost.");
+      }
     }
   } else {
     if (!mqttConnectionLost) {
@@ -868,10 +1678,14 @@ void maintainMQTT() {
         Serial.println(mqtt.state());
       }
       mqttConnectionLost = true;
+      mqttReconnect.lost();
     }
-    if (millis() - mqttReconnectLastAttempt >= mqttReconnectInterval * 1000 && !wifiConnectionLost) {
+    if (mqttReconnect.due() && !wifiConnectionLost) {
+      mqttReconnect.attempt();
       connectMQTT();
-      mqttReconnectLastAttempt = millis();
+      Serial.print("[MQTT] Next retry in ");
+      Serial.print(mqttReconnect.getDelay() / 1000);
+      Serial.println(" seconds if this one fails.");
     }
   }
 }
@@ -881,21 +1695,48 @@ bool initMQTT() {
   mqtt.setServer(MQTT_SERVER, MQTT_PORT);
   mqtt.setKeepAlive(30);
   mqtt.setCallback(mqttCallback);
+  networkClient.setTimeout(mqttConnectTimeout);
   return connectMQTT();
 }
 
+bool connectWiFiCached() { // Connects straight to the last access point with the last IP lease, skipping the scan and DHCP
+  if (!wifiCacheValid || !wm.getWiFiIsSaved()) {
+    return false;
+  }
+  WiFi.config(IPAddress(wifiCacheAddresses[0]), IPAddress(wifiCacheAddresses[1]), IPAddress(wifiCacheAddresses[2]), IPAddress(wifiCacheAddresses[3]));
+  WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), wifiCacheChannel, wifiCacheBssid);
+  unsigned long start = millis();
+  wl_status_t status = WiFi.status();
+  while (status != WL_CONNECTED && status != WL_CONNECT_FAILED && millis() - start < wifiFastConnectTimeout) {
+    delay(10);
+    status = WiFi.status();
+  }
+  if (status == WL_CONNECTED) {
+    return true;
+  }
+  WiFi.config(IPAddress(), IPAddress(), IPAddress()); // Back to DHCP for a full connection
+  return false;
+}
+
 bool connectWiFi() {
+  unsigned long start = millis();
   Serial.print("[WiFi] Connecting to WiFi... ");
-  if(!wm.autoConnect(klimerkoID, wifiConfigPortalPassword)) {
+  bool fast = connectWiFiCached();
+  if(!fast && !wm.autoConnect(klimerkoID, wifiConfigPortalPassword)) {
     Serial.print("Failed! Reason: ");
     Serial.println(WiFi.status());
     wifiConnectionLost = true;
     return false;
   } else {
-    Serial.print("Connected! IP: ");
+    Serial.print(fast ? "Reconnected to last network in " : "Connected in ");
+    Serial.print(millis() - start);
+    Serial.print(" ms! IP: ");
     Serial.println(WiFi.localIP());
     wifiConnectionLost = false;
     ledSuccessBlink = true;
+    if (!fast) {
+      saveWiFiCache();
+    }
     return true;
   }
 }
@@ -907,17 +1748,24 @@ void maintainWiFi() {
       Serial.println(WiFi.localIP());
       wifiConnectionLost = false;
       ledSuccessBlink = true;
+      wifiReconnect.success();
+      saveWiFiCache();
     }
   } else {
     if (!wifiConnectionLost) {
       Serial.print("[WiFi] Connection Lost! Reason: ");
       Serial.println(WiFi.status());
       wifiConnectionLost = true;
+      wifiLostSince = millis();
+      wifiOfflineTimed = false;
+      wifiReconnect.lost();
     }
     // AutoReconnect handles this, this here exists as backup
-    if (millis() - wifiReconnectLastAttempt >= wifiReconnectInterval * 1000 && !wm.getConfigPortalActive()) {
-      connectWiFi();
-      wifiReconnectLastAttempt = millis();
+    if (wifiReconnect.due() && !wm.getConfigPortalActive()) {
+      wifiReconnect.attempt();
+      if (connectWiFi()) {
+        wifiReconnect.success();
+      }
     }
   }
 }
@@ -956,13 +1804,17 @@ void initWiFi() {
   connectWiFi();
 }
 
-void initAvg() {
-  pm1.begin();
-  pm25.begin();
-  pm10.begin();
-  temp.begin();
-  hum.begin();
-  pres.begin();
+void initOutbox() {
+  if (outbox.begin()) {
+    Serial.print("[OUTBOX] Data points waiting to be sent: ");
+    Serial.println(outbox.available());
+  } else {
+    Serial.println("[OUTBOX] Flash filesystem unavailable. Sensor data won't be kept while there's no connection.");
+  }
+}
+
+void initTime() { // Keeps the clock in sync so data points stored while offline can be sent with the time they were taken
+  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
 }
 
 void initPins() {
@@ -987,22 +1839,199 @@ void setup() {
   Serial.print(dataPublishInterval);
   Serial.println(" minutes. |");
   Serial.println(" --------------------------------------------------------------------------------");
-  initAvg();
   initPins();
   initPMS();
   initBME();
   generateID();
   restoreData();
-  initWiFi();
-  initMQTT();
+  initDeepSleep();
+  initOutbox();
+  if (!deepSleepMode || deepSleepPublishing) {
+    initTime();
+    initWiFi();
+    initMQTT();
+  }
+  initScheduler();
   Serial.println("");
 }
 
+void runLoopStage(uint8_t stage) { // Runs one stage of the main loop (called by the scheduler) and records how long it took
+  unsigned long stageStartTime = micros();
+  switch (stage) {
+    case LOOP_STAGE_SENSOR:      sensorLoop();     break;
+    case LOOP_STAGE_WIFI:        maintainWiFi();   break;
+    case LOOP_STAGE_MQTT:        maintainMQTT();   break;
+    case LOOP_STAGE_WIFI_CONFIG: wifiConfigLoop(); break;
+    case LOOP_STAGE_BUTTON:      buttonLoop();     break;
+    case LOOP_STAGE_LED:         ledLoop();        break;
+  }
+  loopTimings[stage].record(micros() - stageStartTime);
+}
+
+void initScheduler() { // Every stage of the main loop runs at its own rate
+  for (int i=0;i<LOOP_STAGE_TOTAL;i++) {
+    if (deepSleepMode && !deepSleepPublishing && (i == LOOP_STAGE_WIFI || i == LOOP_STAGE_MQTT)) {
+      loopStageTasks[i] = taskScheduler::NO_TASK; // Radio stays off on this wake-up
+      continue;
+    }
+    loopStageTasks[i] = scheduler.every(loopStagePeriods[i], runLoopStage, i);
+  }
+  if (deepSleepMode) {
+    scheduler.every(deepSleepCheckInterval, deepSleepLoop);
+  }
+}
+
+void initDeepSleep() { // Picks up where the last wake-up left off and decides if this one publishes
+  if (!deepSleepMode) {
+    return;
+  }
+  bool restored = restoreSleepState();
+  deepSleepPublishing = !restored || sleepData.readings + 1 >= readingsPerPublish();
+  // Read once PMS7003 has been awake long enough
+  sensorReadTime = millis() - readIntervalMillis() + min(pmsWakeBefore * 1000UL, readIntervalMillis());
+  Serial.print("[SLEEP] Deep sleep mode. Reading ");
+  Serial.print(sleepData.readings + 1);
+  Serial.print(" of ");
+  Serial.print(readingsPerPublish());
+  Serial.println(deepSleepPublishing ? ", will publish after it." : ", WiFi stays off.");
+  printEnergyEstimate();
+}
+
+int readingsPerPublish() {
+  int readings = (dataPublishInterval * 60000UL) / readIntervalMillis();
+  return readings > 0 ? readings : 1;
+}
+
+void deepSleepLoop(uint8_t) { // Once the reading is done: publishes if it's time to, then goes back to sleep
+  if (!deepSleepReadDone) {
+    return;
+  }
+  if (deepSleepPublishing) {
+    if (mqttConnectionLost && !wifiConnectionLost && millis() < deepSleepConnectTimeout * 1000UL) {
+      return; // Still connecting
+    }
+    if (!mqttConnectionLost) {
+      publishSensorData();
+      while (outbox.available() > 0 && millis() < deepSleepConnectTimeout * 1000UL && mqtt.connected()) {
+        if (!publishStoredSensorData()) {
+          break; // Nothing more can be sent now, the rest waits for the next wake-up
+        }
+        mqtt.loop();
+        yield();
+      }
+    } else {
+      Serial.println("[SLEEP] Can't send sensor data because Klimerko is not connected to AllThingsTalk");
+      storeSensorData();
+    }
+    sleepData.readings = 0;
+    deepSleepPublishing = false;
+    deepSleepFlushStart = millis();
+  }
+  if (!mqttConnectionLost && mqtt.getInflightCount() > 0 && millis() - deepSleepFlushStart < deepSleepFlushTimeout) {
+    return; // Give AllThingsTalk a moment to confirm data
+  }
+  if (!mqttConnectionLost) {
+    confirmStoredSensorData();
+  }
+  enterDeepSleep();
+}
+
+void enterDeepSleep() {
+  long sleepTime = (long)(sensorReadTime + readIntervalMillis() - min(pmsWakeBefore * 1000UL, readIntervalMillis()) - millis());
+  if (sleepTime < 1000) {
+    sleepTime = 1000;
+  }
+  bool nextPublishes = sleepData.readings + 1 >= readingsPerPublish();
+  saveSleepState(sleepTime);
+  if (!pmsNoSleep && pmsSensorOnline) {
+    pms.sleep();
+  }
+  if (!mqttConnectionLost) {
+    mqtt.disconnect();
+  }
+  Serial.print("[SLEEP] Sleeping for ");
+  Serial.print(sleepTime / 1000);
+  Serial.println(" seconds.");
+  Serial.flush();
+  ESP.deepSleep(sleepTime * 1000ULL, nextPublishes ? RF_DEFAULT : RF_DISABLED);
+}
+
+uint32_t memoryCrc(const uint8_t* data, size_t length) { // CRC-32, to tell data kept in RTC memory from what's there after power-up
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i=0;i<length;i++) {
+    crc ^= data[i];
+    for (int bit=0;bit<8;bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void saveSleepState(long sleepTime) { // Keeps averaging window, reading count and clock in RTC memory
+  int32_t row[sensorChannels];
+  sleepData.rows = sensorAvg.getRows();
+  for (int i=0;i<sleepData.rows;i++) {
+    sensorAvg.getRow(i, row);
+    for (int channel=0;channel<sensorChannels;channel++) {
+      sleepData.window[i][channel] = row[channel] == SENSOR_MISSING ? INT16_MIN : (row[channel] + sleepStateDivisor[channel] / 2) / sleepStateDivisor[channel];
+    }
+  }
+  uint32_t now = currentTime();
+  sleepData.time = now ? now + (sleepTime + 500) / 1000 : 0;
+  sleepData.crc = memoryCrc((const uint8_t*)&sleepData + sizeof(sleepData.crc), sizeof(sleepData) - sizeof(sleepData.crc));
+  ESP.rtcUserMemoryWrite(0, (uint32_t*)&sleepData, sizeof(sleepData));
+}
+
+bool restoreSleepState() { // Restores what saveSleepState() kept, returns false if there was nothing (e.g. after power-up)
+  ESP.rtcUserMemoryRead(0, (uint32_t*)&sleepData, sizeof(sleepData));
+  if (sleepData.crc != memoryCrc((const uint8_t*)&sleepData + sizeof(sleepData.crc), sizeof(sleepData) - sizeof(sleepData.crc))
+      || sleepData.rows > sensorAverageSamplesMax) {
+    memset(&sleepData, 0, sizeof(sleepData));
+    return false;
+  }
+  int32_t row[sensorChannels];
+  for (int i=0;i<sleepData.rows;i++) {
+    for (int channel=0;channel<sensorChannels;channel++) {
+      row[channel] = sleepData.window[i][channel] == INT16_MIN ? SENSOR_MISSING : (int32_t)sleepData.window[i][channel] * sleepStateDivisor[channel];
+    }
+    sensorAvg.addRow(row);
+  }
+  if (sleepData.time) {
+    timeval tv = { (time_t)sleepData.time, 0 };
+    settimeofday(&tv, NULL);
+  }
+  return true;
+}
+
+float energyPerDay(int publishInterval, int samplePeriod) { // [mAh] Estimated use of a day in deep sleep mode
+  float wakeTime = pmsWakeBefore + 1;
+  float readings = 86400.0 / samplePeriod;
+  float publishes = 1440.0 / publishInterval;
+  float awake = readings * wakeTime * energyAwakeCurrent + publishes * energyPublishTime * energyWiFiCurrent;
+  float pms = readings * wakeTime * energyPmsCurrent;
+  float asleep = (86400 - readings * wakeTime - publishes * energyPublishTime) * energySleepCurrent;
+  return (awake + pms + asleep) / 3600;
+}
+
+void printEnergyEstimate() { // Prints estimated daily energy use for the current and other reporting intervals
+  const int intervals[] = { 5, 15, 30, 60 };
+  Serial.print("[SLEEP] Estimated energy use: ");
+  Serial.print(energyPerDay(dataPublishInterval, readIntervalSeconds()), 0);
+  Serial.print(" mAh/day now");
+  for (int i=0;i<4;i++) {
+    int samplePeriod = sensorSamplePeriod > 0 ? sensorSamplePeriod : intervals[i] * 60 / sensorAverageSamples;
+    Serial.print(", ");
+    Serial.print(energyPerDay(intervals[i], samplePeriod), 0);
+    Serial.print(" at ");
+    Serial.print(intervals[i]);
+    Serial.print(" min");
+  }
+  Serial.println();
+}
+
 void loop() {
-  sensorLoop();
-  maintainWiFi();
-  maintainMQTT();
-  wifiConfigLoop();
-  buttonLoop();
-  ledLoop();  
+  unsigned long loopStartTime = micros();
+  unsigned long idle = scheduler.run();
+  loopTimings[LOOP_STAGE_TOTAL].record(micros() - loopStartTime);
+  delay(min(idle, (unsigned long)loopMaxIdle)); // Nothing to do until the next stage is due, leave the time to the WiFi stack
 }
@@ -38,7 +38,7 @@
 */
 /**************************************************************************/
 Adafruit_BME280::Adafruit_BME280()
-    : _cs(-1), _mosi(-1), _miso(-1), _sck(-1)
+    : _cs(-1), _mosi(-1), _miso(-1), _sck(-1), _calibrated(false), _measuring(false)
 { }
 
 /**************************************************************************/
@@ -48,7 +48,7 @@ Adafruit_BME280::Adafruit_BME280()
 */
 /**************************************************************************/
 Adafruit_BME280::Adafruit_BME280(int8_t cspin)
-    : _cs(cspin), _mosi(-1), _miso(-1), _sck(-1)
+    : _cs(cspin), _mosi(-1), _miso(-1), _sck(-1), _calibrated(false), _measuring(false)
 { }
 
 /**************************************************************************/
@@ -61,7 +61,7 @@ Adafruit_BME280::Adafruit_BME280(int8_t cspin)
 */
 /**************************************************************************/
 Adafruit_BME280::Adafruit_BME280(int8_t cspin, int8_t mosipin, int8_t misopin, int8_t sckpin)
-    : _cs(cspin), _mosi(mosipin), _miso(misopin), _sck(sckpin)
+    : _cs(cspin), _mosi(mosipin), _miso(misopin), _sck(sckpin), _calibrated(false), _measuring(false)
 { }
 
 
@@ -148,25 +148,31 @@ bool Adafruit_BME280::init()
     }
 
     // check if sensor, i.e. the chip ID is correct
-    if (read8(BME280_REGISTER_CHIPID) != 0x60)
+    _sensorID = read8(BME280_REGISTER_CHIPID);
+    if (_sensorID != 0x60)
         return false;
 
-    // reset the device using soft-reset
-    // this makes sure the IIR is off, etc.
-    write8(BME280_REGISTER_SOFTRESET, 0xB6);
-
-    // wait for chip to wake up.
-    delay(300);
+    if (_calibrated) {
+        // coefficients are known (see setCalibration), so the chip must
+        // already be running: just stop whatever it was measuring
+        write8(BME280_REGISTER_CONTROL, MODE_SLEEP);
+    } else {
+        // reset the device using soft-reset
+        // this makes sure the IIR is off, etc.
+        write8(BME280_REGISTER_SOFTRESET, 0xB6);
 
-    // if chip is still reading calibration, delay
-    while (isReadingCalibration())
-          delay(100);
+        // wait for chip to wake up (start-up time, DS 1.1)
+        delay(2);
 
-    readCoefficients(); // read trimming parameters, see DS 4.2.2
+        // if chip is still reading calibration, delay
+        while (isReadingCalibration())
+              delay(1);
 
-    setSampling(); // use defaults
+        if (!readCoefficients()) // read trimming parameters, see DS 4.2.2
+            return false;
+    }
 
-    delay(100);
+    setSampling(); // use defaults, measurementReady() tells when the first measurement is done
 
     return true;
 }
@@ -206,6 +212,10 @@ void Adafruit_BME280::setSampling(sensor_mode       mode,
     write8(BME280_REGISTER_CONTROLHUMID, _humReg.get());
     write8(BME280_REGISTER_CONFIG, _configReg.get());
     write8(BME280_REGISTER_CONTROL, _measReg.get());
+
+    // writing forced or normal mode starts a measurement
+    _measureStart = micros();
+    _measuring = (mode != MODE_SLEEP);
 }
 
 
@@ -405,6 +415,41 @@ uint32_t Adafruit_BME280::read24(byte reg)
 }
 
 
+/**************************************************************************/
+/*!
+    @brief  Reads consecutive registers in a single I2C or SPI transaction
+    @param reg the first register address to read from
+    @param buffer where to store the data bytes read from the device
+    @param length the number of registers to read
+    @returns true if all bytes were received
+*/
+/**************************************************************************/
+bool Adafruit_BME280::readBurst(byte reg, uint8_t *buffer, uint8_t length)
+{
+    if (_cs == -1) {
+        _wire -> beginTransmission((uint8_t)_i2caddr);
+        _wire -> write((uint8_t)reg);
+        _wire -> endTransmission();
+        if (_wire -> requestFrom((uint8_t)_i2caddr, (byte)length) != length)
+            return false;
+        for (uint8_t i = 0; i < length; i++)
+            buffer[i] = _wire -> read();
+    } else {
+        if (_sck == -1)
+            SPI.beginTransaction(SPISettings(500000, MSBFIRST, SPI_MODE0));
+        digitalWrite(_cs, LOW);
+        spixfer(reg | 0x80); // read, bit 7 high
+        for (uint8_t i = 0; i < length; i++)
+            buffer[i] = spixfer(0);
+        digitalWrite(_cs, HIGH);
+        if (_sck == -1)
+            SPI.endTransaction(); // release the SPI bus
+    }
+
+    return true;
+}
+
+
 /**************************************************************************/
 /*!
     @brief  Take a new measurement (only possible in forced mode)
@@ -416,12 +461,11 @@ void Adafruit_BME280::takeForcedMeasurement()
     // measurement and we need to set it to forced mode once at this point, so
     // it will take the next measurement and then return to sleep again.
     // In normal mode simply does new measurements periodically.
-    if (_measReg.mode == MODE_FORCED) {
-        // set to forced mode, i.e. "take next measurement"
-        write8(BME280_REGISTER_CONTROL, _measReg.get());
+    if (startForcedMeasurement()) {
         // wait until measurement has been completed, otherwise we would read
         // the values from the last measurement
-        while (read8(BME280_REGISTER_STATUS) & 0x08)
+        delayMicroseconds(getMeasurementTime());
+        while (!measurementReady())
 		delay(1);
     }
 }
@@ -429,31 +473,192 @@ void Adafruit_BME280::takeForcedMeasurement()
 
 /**************************************************************************/
 /*!
-    @brief  Reads the factory-set coefficients
+    @brief  Starts a new measurement and returns without waiting for it
+            (only possible in forced mode). Check measurementReady() on a
+            later loop before reading the values.
+    @returns true if a measurement was started
 */
 /**************************************************************************/
-void Adafruit_BME280::readCoefficients(void)
+bool Adafruit_BME280::startForcedMeasurement()
 {
-    _bme280_calib.dig_T1 = read16_LE(BME280_REGISTER_DIG_T1);
-    _bme280_calib.dig_T2 = readS16_LE(BME280_REGISTER_DIG_T2);
-    _bme280_calib.dig_T3 = readS16_LE(BME280_REGISTER_DIG_T3);
+    if (_measReg.mode != MODE_FORCED)
+        return false;
+
+    // set to forced mode, i.e. "take next measurement"
+    write8(BME280_REGISTER_CONTROL, _measReg.get());
+    _measureStart = micros();
+    _measuring = true;
+    return true;
+}
 
-    _bme280_calib.dig_P1 = read16_LE(BME280_REGISTER_DIG_P1);
-    _bme280_calib.dig_P2 = readS16_LE(BME280_REGISTER_DIG_P2);
-    _bme280_calib.dig_P3 = readS16_LE(BME280_REGISTER_DIG_P3);
-    _bme280_calib.dig_P4 = readS16_LE(BME280_REGISTER_DIG_P4);
-    _bme280_calib.dig_P5 = readS16_LE(BME280_REGISTER_DIG_P5);
-    _bme280_calib.dig_P6 = readS16_LE(BME280_REGISTER_DIG_P6);
-    _bme280_calib.dig_P7 = readS16_LE(BME280_REGISTER_DIG_P7);
-    _bme280_calib.dig_P8 = readS16_LE(BME280_REGISTER_DIG_P8);
-    _bme280_calib.dig_P9 = readS16_LE(BME280_REGISTER_DIG_P9);
 
-    _bme280_calib.dig_H1 = read8(BME280_REGISTER_DIG_H1);
-    _bme280_calib.dig_H2 = readS16_LE(BME280_REGISTER_DIG_H2);
-    _bme280_calib.dig_H3 = read8(BME280_REGISTER_DIG_H3);
-    _bme280_calib.dig_H4 = (read8(BME280_REGISTER_DIG_H4) << 4) | (read8(BME280_REGISTER_DIG_H4+1) & 0xF);
-    _bme280_calib.dig_H5 = (read8(BME280_REGISTER_DIG_H5+1) << 4) | (read8(BME280_REGISTER_DIG_H5) >> 4);
-    _bme280_calib.dig_H6 = (int8_t)read8(BME280_REGISTER_DIG_H6);
+/**************************************************************************/
+/*!
+    @brief  Checks if the measurement started by startForcedMeasurement()
+            is done. The status register is only read once the maximum
+            measurement time has passed, so polling this is cheap.
+    @returns true if the values can be read (also if none was started)
+*/
+/**************************************************************************/
+bool Adafruit_BME280::measurementReady()
+{
+    if (!_measuring)
+        return true;
+    if (micros() - _measureStart < getMeasurementTime())
+        return false;
+    // still measuring, but don't wait forever if the sensor stopped answering
+    if ((read8(BME280_REGISTER_STATUS) & 0x08) && micros() - _measureStart < 2 * getMeasurementTime())
+        return false;
+
+    _measuring = false;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Maximum time a measurement takes with the current oversampling
+            settings (DS 9.1): 1.25 ms + 2.3 ms per temperature sample
+            + 2.3 ms per pressure and humidity sample + 0.575 ms for each
+            of these two that is enabled. The IIR filter works on finished
+            measurements, so it doesn't add to this.
+    @returns the measurement time in microseconds
+*/
+/**************************************************************************/
+uint32_t Adafruit_BME280::getMeasurementTime()
+{
+    const uint8_t samples[] = { 0, 1, 2, 4, 8, 16, 16, 16 }; // oversampling setting to number of samples
+    uint32_t time = 1250 + 2300 * samples[_measReg.osrs_t];
+
+    if (_measReg.osrs_p)
+        time += 2300 * samples[_measReg.osrs_p] + 575;
+    if (_humReg.osrs_h)
+        time += 2300 * samples[_humReg.osrs_h] + 575;
+    return time;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Reads the factory-set coefficients in two burst reads, one of
+            0x88 to 0xA1 and one of 0xE1 to 0xE7
+    @returns true if all coefficients were received
+*/
+/**************************************************************************/
+bool Adafruit_BME280::readCoefficients(void)
+{
+    uint8_t tp[BME280_REGISTER_DIG_H1 - BME280_REGISTER_DIG_T1 + 1];
+    uint8_t h[BME280_REGISTER_DIG_H6 - BME280_REGISTER_DIG_H2 + 1];
+
+    if (!readBurst(BME280_REGISTER_DIG_T1, tp, sizeof(tp)) ||
+        !readBurst(BME280_REGISTER_DIG_H2, h, sizeof(h)))
+        return false;
+
+    // little endian 16 bit value at register reg of the first block
+    #define BME280_TP16(reg) (uint16_t)(tp[(reg) - BME280_REGISTER_DIG_T1] | (tp[(reg) - BME280_REGISTER_DIG_T1 + 1] << 8))
+
+    _bme280_calib.dig_T1 = BME280_TP16(BME280_REGISTER_DIG_T1);
+    _bme280_calib.dig_T2 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_T2);
+    _bme280_calib.dig_T3 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_T3);
+
+    _bme280_calib.dig_P1 = BME280_TP16(BME280_REGISTER_DIG_P1);
+    _bme280_calib.dig_P2 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P2);
+    _bme280_calib.dig_P3 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P3);
+    _bme280_calib.dig_P4 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P4);
+    _bme280_calib.dig_P5 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P5);
+    _bme280_calib.dig_P6 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P6);
+    _bme280_calib.dig_P7 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P7);
+    _bme280_calib.dig_P8 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P8);
+    _bme280_calib.dig_P9 = (int16_t)BME280_TP16(BME280_REGISTER_DIG_P9);
+
+    #undef BME280_TP16
+
+    _bme280_calib.dig_H1 = tp[BME280_REGISTER_DIG_H1 - BME280_REGISTER_DIG_T1];
+    _bme280_calib.dig_H2 = (int16_t)(h[0] | (h[1] << 8));
+    _bme280_calib.dig_H3 = h[BME280_REGISTER_DIG_H3 - BME280_REGISTER_DIG_H2];
+    _bme280_calib.dig_H4 = (h[BME280_REGISTER_DIG_H4 - BME280_REGISTER_DIG_H2] << 4) | (h[BME280_REGISTER_DIG_H4 + 1 - BME280_REGISTER_DIG_H2] & 0xF);
+    _bme280_calib.dig_H5 = (h[BME280_REGISTER_DIG_H5 + 1 - BME280_REGISTER_DIG_H2] << 4) | (h[BME280_REGISTER_DIG_H5 - BME280_REGISTER_DIG_H2] >> 4);
+    _bme280_calib.dig_H6 = (int8_t)h[BME280_REGISTER_DIG_H6 - BME280_REGISTER_DIG_H2];
+
+    _calibrated = true;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Returns the chip ID read by begin()
+    @returns 0x60 for a BME280
+*/
+/**************************************************************************/
+uint32_t Adafruit_BME280::sensorID(void)
+{
+    return _sensorID;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Copies the coefficients read by begin(), e.g. to keep them
+            across a reboot
+    @param calibration where to store the coefficients
+    @returns true if there were coefficients to copy
+*/
+/**************************************************************************/
+bool Adafruit_BME280::getCalibration(bme280_calib_data *calibration)
+{
+    if (!_calibrated)
+        return false;
+    *calibration = _bme280_calib;
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Sets coefficients kept from an earlier getCalibration(), so
+            begin() doesn't reset the sensor and read them again. Only use
+            them for the same sensor, which is still powered (see
+            verifyCalibration()).
+    @param calibration the coefficients
+*/
+/**************************************************************************/
+void Adafruit_BME280::setCalibration(const bme280_calib_data *calibration)
+{
+    _bme280_calib = *calibration;
+    _calibrated = true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Checks coefficients set with setCalibration() against the
+            sensor, by reading the temperature ones (0x88 to 0x8D) again.
+            They differ from sensor to sensor, unlike the chip ID.
+    @returns true if they are the coefficients of this sensor
+*/
+/**************************************************************************/
+bool Adafruit_BME280::verifyCalibration(void)
+{
+    uint8_t t[6];
+
+    if (!_calibrated || !readBurst(BME280_REGISTER_DIG_T1, t, sizeof(t)))
+        return false;
+    return (uint16_t)(t[0] | (t[1] << 8)) == _bme280_calib.dig_T1 &&
+           (int16_t)(t[2] | (t[3] << 8)) == _bme280_calib.dig_T2 &&
+           (int16_t)(t[4] | (t[5] << 8)) == _bme280_calib.dig_T3;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Forgets the coefficients, so the next begin() resets the
+            sensor and reads them again (e.g. after it was replaced)
+*/
+/**************************************************************************/
+void Adafruit_BME280::clearCalibration(void)
+{
+    _calibrated = false;
 }
 
 /**************************************************************************/
@@ -478,11 +683,39 @@ bool Adafruit_BME280::isReadingCalibration(void)
 /**************************************************************************/
 float Adafruit_BME280::readTemperature(void)
 {
-    int32_t var1, var2;
+    return compensateTemperature(read24(BME280_REGISTER_TEMPDATA));
+}
+
 
-    int32_t adc_T = read24(BME280_REGISTER_TEMPDATA);
+/**************************************************************************/
+/*!
+    @brief  Compensates a raw temperature reading and updates t_fine
+    @param adc_T the 24 bit temperature register value
+    @returns the temperature in degrees Celsius
+*/
+/**************************************************************************/
+float Adafruit_BME280::compensateTemperature(int32_t adc_T)
+{
     if (adc_T == 0x800000) // value in case temp measurement was disabled
         return NAN;
+
+    float T = compensateTemperatureFixed(adc_T);
+    return T/100;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Compensates a raw temperature reading in integer arithmetic
+            (DS 4.2.3) and updates t_fine
+    @param adc_T the 24 bit temperature register value
+    @returns the temperature in 0.01 degrees Celsius
+*/
+/**************************************************************************/
+int32_t Adafruit_BME280::compensateTemperatureFixed(int32_t adc_T)
+{
+    int32_t var1, var2;
+
     adc_T >>= 4;
 
     var1 = ((((adc_T>>3) - ((int32_t)_bme280_calib.dig_T1 <<1))) *
@@ -494,8 +727,7 @@ float Adafruit_BME280::readTemperature(void)
 
     t_fine = var1 + var2;
 
-    float T = (t_fine * 5 + 128) >> 8;
-    return T/100;
+    return (t_fine * 5 + 128) >> 8;
 }
 
 
@@ -506,13 +738,38 @@ float Adafruit_BME280::readTemperature(void)
 */
 /**************************************************************************/
 float Adafruit_BME280::readPressure(void) {
-    int64_t var1, var2, p;
-
     readTemperature(); // must be done first to get t_fine
 
-    int32_t adc_P = read24(BME280_REGISTER_PRESSUREDATA);
+    return compensatePressure(read24(BME280_REGISTER_PRESSUREDATA));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Compensates a raw pressure reading, t_fine must be up to date
+    @param adc_P the 24 bit pressure register value
+    @returns the pressure in Pascal
+*/
+/**************************************************************************/
+float Adafruit_BME280::compensatePressure(int32_t adc_P) {
     if (adc_P == 0x800000) // value in case pressure measurement was disabled
         return NAN;
+
+    return (float)compensatePressureFixed(adc_P)/256;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Compensates a raw pressure reading in integer arithmetic
+            (DS 4.2.3), t_fine must be up to date
+    @param adc_P the 24 bit pressure register value
+    @returns the pressure in Pascal as Q24.8 (Pascal * 256)
+*/
+/**************************************************************************/
+uint32_t Adafruit_BME280::compensatePressureFixed(int32_t adc_P) {
+    int64_t var1, var2, p;
+
     adc_P >>= 4;
 
     var1 = ((int64_t)t_fine) - 128000;
@@ -532,7 +789,7 @@ float Adafruit_BME280::readPressure(void) {
     var2 = (((int64_t)_bme280_calib.dig_P8) * p) >> 19;
 
     p = ((p + var1 + var2) >> 8) + (((int64_t)_bme280_calib.dig_P7)<<4);
-    return (float)p/256;
+    return (uint32_t)p;
 }
 
 
@@ -545,10 +802,35 @@ float Adafruit_BME280::readPressure(void) {
 float Adafruit_BME280::readHumidity(void) {
     readTemperature(); // must be done first to get t_fine
 
-    int32_t adc_H = read16(BME280_REGISTER_HUMIDDATA);
+    return compensateHumidity(read16(BME280_REGISTER_HUMIDDATA));
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Compensates a raw humidity reading, t_fine must be up to date
+    @param adc_H the 16 bit humidity register value
+    @returns the relative humidity in percent
+*/
+/**************************************************************************/
+float Adafruit_BME280::compensateHumidity(int32_t adc_H) {
     if (adc_H == 0x8000) // value in case humidity measurement was disabled
         return NAN;
-        
+
+    float h = compensateHumidityFixed(adc_H);
+    return  h / 1024.0;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Compensates a raw humidity reading in integer arithmetic
+            (DS 4.2.3), t_fine must be up to date
+    @param adc_H the 16 bit humidity register value
+    @returns the relative humidity in percent as Q22.10 (percent * 1024)
+*/
+/**************************************************************************/
+uint32_t Adafruit_BME280::compensateHumidityFixed(int32_t adc_H) {
     int32_t v_x1_u32r;
 
     v_x1_u32r = (t_fine - ((int32_t)76800));
@@ -564,8 +846,83 @@ float Adafruit_BME280::readHumidity(void) {
 
     v_x1_u32r = (v_x1_u32r < 0) ? 0 : v_x1_u32r;
     v_x1_u32r = (v_x1_u32r > 419430400) ? 419430400 : v_x1_u32r;
-    float h = (v_x1_u32r>>12);
-    return  h / 1024.0;
+    return (uint32_t)(v_x1_u32r>>12);
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Reads temperature, pressure and humidity of the same measurement.
+            All 8 data registers (0xF7 to 0xFE) are read in one transaction
+            and temperature is compensated only once, instead of the 5
+            transactions and 3 compensations of calling readTemperature(),
+            readPressure() and readHumidity().
+    @param temperature where to store the temperature (degrees Celsius)
+    @param pressure where to store the pressure (Pascal)
+    @param humidity where to store the relative humidity (percent)
+    @returns true if the sensor answered, otherwise all values are NAN
+*/
+/**************************************************************************/
+bool Adafruit_BME280::readAll(float *temperature, float *pressure, float *humidity) {
+    int32_t adc_T, adc_P, adc_H;
+
+    if (!readRaw(&adc_T, &adc_P, &adc_H)) {
+        *temperature = *pressure = *humidity = NAN;
+        return false;
+    }
+
+    *temperature = compensateTemperature(adc_T); // must be done first to get t_fine
+    *pressure = compensatePressure(adc_P);
+    *humidity = compensateHumidity(adc_H);
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Same as readAll(), but in integer arithmetic only (the ESP8266
+            has no FPU), with the values in fixed point as the datasheet's
+            compensation formulas give them.
+    @param temperature where to store the temperature (0.01 degrees Celsius)
+    @param pressure where to store the pressure (Pascal * 256, Q24.8)
+    @param humidity where to store the relative humidity (percent * 1024, Q22.10)
+    @returns true if the sensor answered and all three are measured
+*/
+/**************************************************************************/
+bool Adafruit_BME280::readAllFixed(int32_t *temperature, uint32_t *pressure, uint32_t *humidity) {
+    int32_t adc_T, adc_P, adc_H;
+
+    if (!readRaw(&adc_T, &adc_P, &adc_H) ||
+        adc_T == 0x800000 || adc_P == 0x800000 || adc_H == 0x8000) // a measurement is disabled
+        return false;
+
+    *temperature = compensateTemperatureFixed(adc_T); // must be done first to get t_fine
+    *pressure = compensatePressureFixed(adc_P);
+    *humidity = compensateHumidityFixed(adc_H);
+    return true;
+}
+
+
+/**************************************************************************/
+/*!
+    @brief  Reads the raw values of all 8 data registers (0xF7 to 0xFE)
+            in one transaction
+    @param adc_T where to store the 24 bit temperature value
+    @param adc_P where to store the 24 bit pressure value
+    @param adc_H where to store the 16 bit humidity value
+    @returns true if the sensor answered
+*/
+/**************************************************************************/
+bool Adafruit_BME280::readRaw(int32_t *adc_T, int32_t *adc_P, int32_t *adc_H) {
+    uint8_t data[8];
+
+    if (!readBurst(BME280_REGISTER_PRESSUREDATA, data, sizeof(data)))
+        return false;
+
+    *adc_P = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    *adc_T = ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8) | data[5];
+    *adc_H = ((uint32_t)data[6] << 8) | data[7];
+    return true;
 }
 
 
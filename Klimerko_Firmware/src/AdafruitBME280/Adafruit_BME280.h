@@ -212,9 +212,20 @@ class Adafruit_BME280 {
 			 );
                    
         void takeForcedMeasurement();
+        bool startForcedMeasurement();
+        bool measurementReady();
+        uint32_t getMeasurementTime();
+
+        uint32_t sensorID(void);
+        bool  getCalibration(bme280_calib_data *calibration);
+        void  setCalibration(const bme280_calib_data *calibration);
+        bool  verifyCalibration(void);
+        void  clearCalibration(void);
         float readTemperature(void);
         float readPressure(void);
         float readHumidity(void);
+        bool  readAll(float *temperature, float *pressure, float *humidity);
+        bool  readAllFixed(int32_t *temperature, uint32_t *pressure, uint32_t *humidity);
         
         float readAltitude(float seaLevel);
         float seaLevelForAltitude(float altitude, float pressure);
@@ -222,7 +233,7 @@ class Adafruit_BME280 {
         
     private:
 		TwoWire *_wire;
-        void readCoefficients(void);
+        bool readCoefficients(void);
         bool isReadingCalibration(void);
         uint8_t spixfer(uint8_t x);
 
@@ -233,6 +244,15 @@ class Adafruit_BME280 {
         int16_t   readS16(byte reg);
         uint16_t  read16_LE(byte reg); // little endian
         int16_t   readS16_LE(byte reg); // little endian
+        bool      readBurst(byte reg, uint8_t *buffer, uint8_t length);
+
+        float     compensateTemperature(int32_t adc_T);
+        float     compensatePressure(int32_t adc_P);
+        float     compensateHumidity(int32_t adc_H);
+        int32_t   compensateTemperatureFixed(int32_t adc_T);
+        uint32_t  compensatePressureFixed(int32_t adc_P);
+        uint32_t  compensateHumidityFixed(int32_t adc_H);
+        bool      readRaw(int32_t *adc_T, int32_t *adc_P, int32_t *adc_H);
 
         uint8_t   _i2caddr;
         int32_t   _sensorID;
@@ -241,6 +261,10 @@ class Adafruit_BME280 {
         int8_t _cs, _mosi, _miso, _sck;
 
         bme280_calib_data _bme280_calib;
+        bool      _calibrated;       // _bme280_calib holds valid coefficients, init() won't read them again
+
+        bool      _measuring;        // a forced measurement was started and not collected yet
+        uint32_t  _measureStart;     // micros() when it was started
 
         // The config register
         struct config {
@@ -180,8 +180,46 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
     if (!connected()) {
-        int result = 0;
+        if (!beginConnect(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+            return false;
+        }
+        while (connecting()) {
+            continueConnect();
+            yield();
+        }
+        return connected();
+    }
+    return true;
+}
+
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass) {
+    return beginConnect(id,user,pass,0,0,0,0,1);
+}
+
+boolean PubSubClient::beginConnect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (connected() || connecting()) {
+        return true;
+    }
+    connectId = id;
+    connectUser = user;
+    connectPass = pass;
+    connectWillTopic = willTopic;
+    connectWillQos = willQos;
+    connectWillRetain = willRetain;
+    connectWillMessage = willMessage;
+    connectCleanSession = cleanSession;
+    _state = MQTT_CONNECTING_TCP;
+    return true;
+}
 
+boolean PubSubClient::connecting() {
+    return _state == MQTT_CONNECTING_TCP || _state == MQTT_CONNECT_SENT || _state == MQTT_AWAITING_CONNACK;
+}
+
+// Takes the connection one step further, returns 1 once connected
+boolean PubSubClient::continueConnect() {
+    if (_state == MQTT_CONNECTING_TCP) {
+        int result = 0;
 
         if(_client->connected()) {
             result = 1;
@@ -193,181 +231,239 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
             }
         }
 
-        if (result == 1) {
-            nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = MQTT_MAX_HEADER_SIZE;
-            unsigned int j;
+        if (result != 1) {
+            _state = MQTT_CONNECT_FAILED;
+            return false;
+        }
+        if (!sendConnect()) {
+            _state = MQTT_CONNECT_FAILED;
+            return false;
+        }
+        lastInActivity = lastOutActivity = millis();
+        connackLength = 0;
+        readStage = MQTT_READ_IDLE;
+        _state = MQTT_CONNECT_SENT;
+        return false;
+    }
 
-#if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 7
-#endif
-            for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                this->buffer[length++] = d[j];
+    if (_state == MQTT_CONNECT_SENT || _state == MQTT_AWAITING_CONNACK) {
+        // Take whatever part of the 4 byte CONNACK has arrived, without waiting for the rest
+        while (connackLength < 4 && _client->available()) {
+            this->buffer[connackLength++] = _client->read();
+        }
+        if (connackLength < 4) {
+            if (connackLength > 0) {
+                _state = MQTT_AWAITING_CONNACK;
             }
-
-            uint8_t v;
-            if (willTopic) {
-                v = 0x04|(willQos<<3)|(willRetain<<5);
-            } else {
-                v = 0x00;
+            if (millis()-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+                _state = MQTT_CONNECTION_TIMEOUT;
+                _client->stop();
+            } else if (!_client->connected()) {
+                _state = MQTT_CONNECT_FAILED;
+                _client->stop();
             }
-            if (cleanSession) {
-                v = v|0x02;
+            return false;
+        }
+        if ((buffer[0]&0xF0) == MQTTCONNACK && buffer[1] == 2) {
+            if (buffer[3] == 0) {
+                lastInActivity = millis();
+                pingOutstanding = false;
+                _state = MQTT_CONNECTED;
+                resendInflight();
+                return true;
+            } else {
+                _state = buffer[3];
             }
+        } else {
+            _state = MQTT_CONNECT_FAILED;
+        }
+        _client->stop();
+        return false;
+    }
+    return _state == MQTT_CONNECTED;
+}
 
-            if(user != NULL) {
-                v = v|0x80;
+boolean PubSubClient::sendConnect() {
+    const char* id = connectId;
+    const char* user = connectUser;
+    const char* pass = connectPass;
+    const char* willTopic = connectWillTopic;
+    const char* willMessage = connectWillMessage;
 
-                if(pass != NULL) {
-                    v = v|(0x80>>1);
-                }
-            }
-            this->buffer[length++] = v;
-
-            this->buffer[length++] = ((this->keepAlive) >> 8);
-            this->buffer[length++] = ((this->keepAlive) & 0xFF);
-
-            CHECK_STRING_LENGTH(length,id)
-            length = writeString(id,this->buffer,length);
-            if (willTopic) {
-                CHECK_STRING_LENGTH(length,willTopic)
-                length = writeString(willTopic,this->buffer,length);
-                CHECK_STRING_LENGTH(length,willMessage)
-                length = writeString(willMessage,this->buffer,length);
-            }
+    if (getInflightCount() == 0) {
+        nextMsgId = 1;
+    }
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = MQTT_MAX_HEADER_SIZE;
+    unsigned int j;
 
-            if(user != NULL) {
-                CHECK_STRING_LENGTH(length,user)
-                length = writeString(user,this->buffer,length);
-                if(pass != NULL) {
-                    CHECK_STRING_LENGTH(length,pass)
-                    length = writeString(pass,this->buffer,length);
-                }
-            }
+#if MQTT_VERSION == MQTT_VERSION_3_1
+    uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 9
+#elif MQTT_VERSION == MQTT_VERSION_3_1_1
+    uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 7
+#endif
+    for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
+        this->buffer[length++] = d[j];
+    }
 
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+    uint8_t v;
+    if (willTopic) {
+        v = 0x04|(connectWillQos<<3)|(connectWillRetain<<5);
+    } else {
+        v = 0x00;
+    }
+    if (connectCleanSession) {
+        v = v|0x02;
+    }
 
-            lastInActivity = lastOutActivity = millis();
+    if(user != NULL) {
+        v = v|0x80;
 
-            while (!_client->available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
-            }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
+        if(pass != NULL) {
+            v = v|(0x80>>1);
+        }
+    }
+    this->buffer[length++] = v;
+
+    this->buffer[length++] = ((this->keepAlive) >> 8);
+    this->buffer[length++] = ((this->keepAlive) & 0xFF);
+
+    CHECK_STRING_LENGTH(length,id)
+    length = writeString(id,this->buffer,length);
+    if (willTopic) {
+        CHECK_STRING_LENGTH(length,willTopic)
+        length = writeString(willTopic,this->buffer,length);
+        CHECK_STRING_LENGTH(length,willMessage)
+        length = writeString(willMessage,this->buffer,length);
+    }
 
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
-            }
-            _client->stop();
-        } else {
-            _state = MQTT_CONNECT_FAILED;
+    if(user != NULL) {
+        CHECK_STRING_LENGTH(length,user)
+        length = writeString(user,this->buffer,length);
+        if(pass != NULL) {
+            CHECK_STRING_LENGTH(length,pass)
+            length = writeString(pass,this->buffer,length);
         }
-        return false;
     }
-    return true;
-}
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) {
-   uint32_t previousMillis = millis();
-   while(!_client->available()) {
-     yield();
-     uint32_t currentMillis = millis();
-     if(currentMillis - previousMillis >= ((int32_t) this->socketTimeout * 1000)){
-       return false;
-     }
-   }
-   *result = _client->read();
-   return true;
-}
-
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
-  uint16_t current_index = *index;
-  uint8_t * write_address = &(result[current_index]);
-  if(readByte(write_address)){
-    *index = current_index + 1;
-    return true;
-  }
-  return false;
+    return write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
 }
 
+// Takes as much of the incoming packet as has arrived (up to MQTT_MAX_READ_PER_LOOP bytes) without
+// waiting for the rest. Returns the number of bytes in buffer once a whole packet is in, 0 until then
 uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
-    uint16_t len = 0;
-    if(!readByte(this->buffer, &len)) return 0;
-    bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint32_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint32_t start = 0;
+    unsigned long t = millis();
+    if (readStage != MQTT_READ_IDLE && t - readLastActivity >= ((int32_t) this->socketTimeout*1000UL)) {
+        // Rest of the packet never came
+        readStage = MQTT_READ_IDLE;
+        _state = MQTT_CONNECTION_TIMEOUT;
+        _client->stop();
+        return 0;
+    }
 
-    do {
-        if (len == 5) {
-            // Invalid remaining length encoding - kill the connection
-            _state = MQTT_DISCONNECTED;
-            _client->stop();
-            return 0;
-        }
-        if(!readByte(&digit)) return 0;
-        this->buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier <<=7; //multiplier *= 128
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
-
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if(!readByte(this->buffer, &len)) return 0;
-        if(!readByte(this->buffer, &len)) return 0;
-        skip = (this->buffer[*lengthLength+1]<<8)+this->buffer[*lengthLength+2];
-        start = 2;
-        if (this->buffer[0]&MQTTQOS1) {
-            // skip message id
-            skip += 2;
-        }
-    }
-    uint32_t idx = len;
-
-    for (uint32_t i = start;i<length;i++) {
-        if(!readByte(&digit)) return 0;
-        if (this->stream) {
-            if (isPublish && idx-*lengthLength-2>skip) {
-                this->stream->write(digit);
+    uint16_t budget = MQTT_MAX_READ_PER_LOOP;
+    while (budget > 0 && _client->available() > 0) {
+        if (readStage == MQTT_READ_IDLE) {
+            this->buffer[0] = _client->read();
+            readLength = 1;
+            readRemaining = 0;
+            readMultiplier = 1;
+            readPayloadStart = 0;
+            readStage = MQTT_READ_LENGTH;
+        } else if (readStage == MQTT_READ_LENGTH) {
+            if (readLength == 5) {
+                // Invalid remaining length encoding - kill the connection
+                readStage = MQTT_READ_IDLE;
+                _state = MQTT_DISCONNECTED;
+                _client->stop();
+                return 0;
             }
+            uint8_t digit = _client->read();
+            this->buffer[readLength++] = digit;
+            readRemaining += (digit & 127) * readMultiplier;
+            readMultiplier <<= 7; //multiplier *= 128
+            if ((digit & 128) == 0) {
+                readLengthLength = readLength-1;
+                readPosition = readLength;
+                readStage = MQTT_READ_BODY;
+            }
+        } else {
+            if (readRemaining == 0) {
+                break;
+            }
+            bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
+            uint32_t bodyRead = readPosition-readLengthLength-1;
+            uint32_t n = readRemaining;
+            if (isPublish && bodyRead < 2) {
+                // Topic length first, to know where the payload starts
+                n = 2-bodyRead;
+            }
+            if (n > budget) {
+                n = budget;
+            }
+            uint8_t scratch[64];
+            uint8_t* target;
+            if (readLength < this->bufferSize) {
+                target = this->buffer+readLength;
+                if (n > (uint32_t)(this->bufferSize-readLength)) {
+                    n = this->bufferSize-readLength;
+                }
+            } else {
+                // Past the end of buffer, read it in chunks just to throw it (or stream it) away
+                target = scratch;
+                if (n > sizeof(scratch)) {
+                    n = sizeof(scratch);
+                }
+            }
+            int got = _client->read(target, n);
+            if (got <= 0) {
+                break;
+            }
+            if (this->stream && isPublish && readPayloadStart > 0) {
+                uint32_t end = readPosition+got;
+                if (end > readPayloadStart) {
+                    uint32_t from = readPosition > readPayloadStart ? readPosition : readPayloadStart;
+                    this->stream->write(target+(from-readPosition), end-from);
+                }
+            }
+            if (target != scratch) {
+                readLength += got;
+            }
+            readPosition += got;
+            readRemaining -= got;
+            budget -= got;
+            if (isPublish && readPayloadStart == 0 && readPosition-readLengthLength-1 == 2) {
+                readPayloadStart = readPosition+(this->buffer[readLengthLength+1]<<8)+this->buffer[readLengthLength+2];
+                if (this->buffer[0]&MQTTQOS1) {
+                    // skip message id
+                    readPayloadStart += 2;
+                }
+            }
+            continue;
         }
-
-        if (len < this->bufferSize) {
-            this->buffer[len] = digit;
-            len++;
-        }
-        idx++;
+        budget--;
+    }
+    if (budget < MQTT_MAX_READ_PER_LOOP) {
+        readLastActivity = t;
     }
 
-    if (!this->stream && idx > this->bufferSize) {
-        len = 0; // This will cause the packet to be ignored.
+    if (readStage != MQTT_READ_BODY || readRemaining > 0) {
+        return 0;
+    }
+    readStage = MQTT_READ_IDLE;
+    *lengthLength = readLengthLength;
+    if (!this->stream && readPosition > this->bufferSize) {
+        return 0; // This will cause the packet to be ignored.
     }
-    return len;
+    return readLength;
 }
 
 boolean PubSubClient::loop() {
+    if (connecting()) {
+        return continueConnect();
+    }
     if (connected()) {
         unsigned long t = millis();
         if ((t - lastInActivity > this->keepAlive*1000UL) || (t - lastOutActivity > this->keepAlive*1000UL)) {
@@ -384,7 +480,7 @@ boolean PubSubClient::loop() {
                 pingOutstanding = true;
             }
         }
-        if (_client->available()) {
+        if (_client->available() || readStage != MQTT_READ_IDLE) {
             uint8_t llen;
             uint16_t len = readPacket(&llen);
             uint16_t msgId = 0;
@@ -416,6 +512,8 @@ boolean PubSubClient::loop() {
                             callback(topic,payload,len-llen-3-tl);
                         }
                     }
+                } else if (type == MQTTPUBACK) {
+                    handleAck((this->buffer[2]<<8)+this->buffer[3]);
                 } else if (type == MQTTPINGREQ) {
                     this->buffer[0] = MQTTPINGRESP;
                     this->buffer[1] = 0;
@@ -446,14 +544,35 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 }
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
+    return publish(topic, payload, plength, retained, 0);
+}
+
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos) {
     if (connected()) {
-        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+strnlen(topic, this->bufferSize) + plength) {
+        if (qos > 1) {
+            return false;
+        }
+        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+strnlen(topic, this->bufferSize) + (qos ? 2 : 0) + plength) {
             // Too long
             return false;
         }
+        if (qos && !findInflight(0)) {
+            // Too many publishes waiting for acknowledgement
+            return false;
+        }
+        if (qos && 2+strnlen(topic, this->bufferSize)+2+plength > MQTT_INFLIGHT_PACKET_SIZE) {
+            // Couldn't be kept for resending after a reconnect
+            return false;
+        }
         // Leave room in the buffer for header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
         length = writeString(topic,this->buffer,length);
+        uint16_t msgId = 0;
+        if (qos) {
+            msgId = nextPacketId();
+            this->buffer[length++] = (msgId >> 8);
+            this->buffer[length++] = (msgId & 0xFF);
+        }
 
         // Add payload
         uint16_t i;
@@ -463,10 +582,24 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 
         // Write the header
         uint8_t header = MQTTPUBLISH;
+        if (qos) {
+            header |= MQTTQOS1;
+        }
         if (retained) {
             header |= 1;
         }
-        return write(header,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        INFLIGHT* slot = NULL;
+        if (qos) {
+            slot = keepInflight(msgId, header, this->buffer+MQTT_MAX_HEADER_SIZE, length-MQTT_MAX_HEADER_SIZE);
+        }
+        if (!write(header,this->buffer,length-MQTT_MAX_HEADER_SIZE)) {
+            if (slot) {
+                // Caller is told it failed, so don't resend it later as well
+                slot->msgId = 0;
+            }
+            return false;
+        }
+        return true;
     }
     return false;
 }
@@ -524,36 +657,190 @@ boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsig
 }
 
 boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
+    return beginPublish(topic, plength, retained, 0);
+}
+
+boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained, uint8_t qos) {
     if (connected()) {
+        if (qos > 1) {
+            return false;
+        }
+        if (qos && !findInflight(0)) {
+            // Too many publishes waiting for acknowledgement
+            return false;
+        }
+        if (qos && 2+strnlen(topic, this->bufferSize)+2+plength > MQTT_INFLIGHT_PACKET_SIZE) {
+            // Couldn't be kept for resending after a reconnect
+            return false;
+        }
         // Send the header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
         length = writeString(topic,this->buffer,length);
+        uint16_t msgId = 0;
+        if (qos) {
+            msgId = nextPacketId();
+            this->buffer[length++] = (msgId >> 8);
+            this->buffer[length++] = (msgId & 0xFF);
+        }
         uint8_t header = MQTTPUBLISH;
+        if (qos) {
+            header |= MQTTQOS1;
+        }
         if (retained) {
             header |= 1;
         }
         size_t hlen = buildHeader(header, this->buffer, plength+length-MQTT_MAX_HEADER_SIZE);
         uint16_t rc = _client->write(this->buffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
         lastOutActivity = millis();
-        return (rc == (length-(MQTT_MAX_HEADER_SIZE-hlen)));
+        if (rc != (length-(MQTT_MAX_HEADER_SIZE-hlen))) {
+            return false;
+        }
+        if (qos) {
+            // Payload written until endPublish() is copied into the slot as well
+            inflightWriting = keepInflight(msgId, header, this->buffer+MQTT_MAX_HEADER_SIZE, length-MQTT_MAX_HEADER_SIZE);
+            inflightExpected = length-MQTT_MAX_HEADER_SIZE+plength;
+        }
+        return true;
     }
     return false;
 }
 
 int PubSubClient::endPublish() {
- return 1;
+    if (inflightWriting && inflightWriting->length != inflightExpected) {
+        // Not all of the payload was written, so it can't be resent as it is
+        inflightWriting->length = 0;
+    }
+    inflightWriting = NULL;
+    return 1;
 }
 
 size_t PubSubClient::write(uint8_t data) {
     lastOutActivity = millis();
+    appendInflight(&data, 1);
     return _client->write(data);
 }
 
 size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
     lastOutActivity = millis();
+    appendInflight(buffer, size);
     return _client->write(buffer,size);
 }
 
+uint16_t PubSubClient::nextPacketId() {
+    // Skip ids still used by publishes waiting for acknowledgement
+    do {
+        nextMsgId++;
+        if (nextMsgId == 0) {
+            nextMsgId = 1;
+        }
+    } while (findInflight(nextMsgId));
+    return nextMsgId;
+}
+
+PubSubClient::INFLIGHT* PubSubClient::findInflight(uint16_t msgId) {
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (inflight[i].msgId == msgId) {
+            return &inflight[i];
+        }
+    }
+    return NULL;
+}
+
+PubSubClient::INFLIGHT* PubSubClient::keepInflight(uint16_t msgId, uint8_t header, const uint8_t* buf, uint16_t length) {
+    INFLIGHT* slot = findInflight(0);
+    if (!slot) {
+        return NULL;
+    }
+    slot->msgId = msgId;
+    slot->header = header;
+    slot->sentAt = millis();
+    if (length <= MQTT_INFLIGHT_PACKET_SIZE) {
+        memcpy(slot->packet, buf, length);
+        slot->length = length;
+    } else {
+        slot->length = 0;
+    }
+    return slot;
+}
+
+void PubSubClient::appendInflight(const uint8_t* buf, size_t size) {
+    if (!inflightWriting || inflightWriting->length == 0) {
+        return;
+    }
+    if (inflightWriting->length + size > MQTT_INFLIGHT_PACKET_SIZE) {
+        // Doesn't fit, it will be tracked but can't be resent
+        inflightWriting->length = 0;
+        return;
+    }
+    memcpy(inflightWriting->packet + inflightWriting->length, buf, size);
+    inflightWriting->length += size;
+}
+
+void PubSubClient::handleAck(uint16_t msgId) {
+    INFLIGHT* slot = findInflight(msgId);
+    if (msgId == 0 || !slot) {
+        return;
+    }
+    uint32_t latency = millis() - slot->sentAt;
+    if (ackStats.acked == 0 || latency < ackStats.latencyMin) {
+        ackStats.latencyMin = latency;
+    }
+    if (latency > ackStats.latencyMax) {
+        ackStats.latencyMax = latency;
+    }
+    ackStats.latencySum += latency;
+    ackStats.acked++;
+    if (slot == inflightWriting) {
+        inflightWriting = NULL;
+    }
+    slot->msgId = 0;
+}
+
+void PubSubClient::resendInflight() {
+    if (inflightWriting) {
+        // Connection was lost in the middle of beginPublish/endPublish
+        inflightWriting->length = 0;
+        inflightWriting = NULL;
+    }
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        INFLIGHT* slot = &inflight[i];
+        if (slot->msgId == 0) {
+            continue;
+        }
+        if (slot->length == 0) {
+            // Wasn't kept, so it's lost
+            slot->msgId = 0;
+            ackStats.dropped++;
+            continue;
+        }
+        // A clean session starts over on the broker, so it's sent as a new publish rather than a duplicate
+        uint8_t header[MQTT_MAX_HEADER_SIZE];
+        size_t hlen = buildHeader(connectCleanSession ? slot->header : (slot->header | MQTTDUP), header, slot->length);
+        _client->write(header+(MQTT_MAX_HEADER_SIZE-hlen), hlen);
+        _client->write(slot->packet, slot->length);
+        slot->sentAt = lastOutActivity = millis();
+        ackStats.retransmitted++;
+    }
+}
+
+uint8_t PubSubClient::getInflightCount() {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        if (inflight[i].msgId != 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+PubSubClient::ACK_STATS PubSubClient::getAckStats() {
+    return ackStats;
+}
+
+void PubSubClient::resetAckStats() {
+    memset(&ackStats, 0, sizeof(ackStats));
+}
+
 size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length) {
     uint8_t lenBuf[4];
     uint8_t llen = 0;
@@ -621,12 +908,9 @@ boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
     if (connected()) {
         // Leave room in the buffer for header and variable length field
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
+        uint16_t msgId = nextPacketId();
+        this->buffer[length++] = (msgId >> 8);
+        this->buffer[length++] = (msgId & 0xFF);
         length = writeString((char*)topic, this->buffer,length);
         this->buffer[length++] = qos;
         return write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
@@ -645,12 +929,9 @@ boolean PubSubClient::unsubscribe(const char* topic) {
     }
     if (connected()) {
         uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
+        uint16_t msgId = nextPacketId();
+        this->buffer[length++] = (msgId >> 8);
+        this->buffer[length++] = (msgId & 0xFF);
         length = writeString(topic, this->buffer,length);
         return write(MQTTUNSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
     }
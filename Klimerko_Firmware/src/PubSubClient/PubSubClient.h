@@ -36,12 +36,33 @@
 #define MQTT_SOCKET_TIMEOUT 15
 #endif
 
+// MQTT_MAX_INFLIGHT : Maximum number of QoS 1 publishes waiting for a PUBACK at once
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+// MQTT_INFLIGHT_PACKET_SIZE : Bytes kept per QoS 1 publish (topic, message id and payload) so it
+//  can be resent after a reconnect. Bigger QoS 1 publishes are refused. Every slot is static RAM, so it's sized
+//  for the biggest QoS 1 message Klimerko sends: a stored data point with times (under 600 bytes).
+#ifndef MQTT_INFLIGHT_PACKET_SIZE
+#define MQTT_INFLIGHT_PACKET_SIZE 768
+#endif
+
+// MQTT_MAX_READ_PER_LOOP : Most bytes taken from the network in one loop() call. The rest of
+//  a bigger packet is picked up in the following calls.
+#ifndef MQTT_MAX_READ_PER_LOOP
+#define MQTT_MAX_READ_PER_LOOP 512
+#endif
+
 // MQTT_MAX_TRANSFER_SIZE : limit how much data is passed to the network client
 //  in each write call. Needed for the Arduino Wifi Shield. Leave undefined to
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+#define MQTT_AWAITING_CONNACK       -7 // Part of the CONNACK has arrived
+#define MQTT_CONNECT_SENT           -6 // Waiting for the server to answer CONNECT
+#define MQTT_CONNECTING_TCP         -5 // Network connection will be opened on next loop()
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -72,6 +93,12 @@
 #define MQTTQOS0        (0 << 1)
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
+#define MQTTDUP         (1 << 3)
+
+// Stages of receiving a packet
+#define MQTT_READ_IDLE   0
+#define MQTT_READ_LENGTH 1
+#define MQTT_READ_BODY   2
 
 // Maximum size of fixed header and variable length size header
 #define MQTT_MAX_HEADER_SIZE 5
@@ -86,7 +113,24 @@
 #define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->bufferSize) > this->bufferSize) {_client->stop();return false;}
 
 class PubSubClient : public Print {
+public:
+   struct ACK_STATS {
+      uint32_t acked;         // QoS 1 publishes acknowledged by the broker
+      uint32_t retransmitted; // QoS 1 publishes resent after a reconnect
+      uint32_t dropped;       // QoS 1 publishes given up on because they weren't kept whole for resending
+      uint32_t latencyMin;    // Milliseconds from (last) transmission to PUBACK
+      uint32_t latencyMax;
+      uint32_t latencySum;
+   };
+
 private:
+   struct INFLIGHT {
+      uint16_t msgId;         // 0 if the slot is free
+      uint8_t header;         // Fixed header byte, without DUP
+      unsigned long sentAt;
+      uint16_t length;        // Bytes kept in packet (variable header + payload), 0 if it didn't fit
+      uint8_t packet[MQTT_INFLIGHT_PACKET_SIZE];
+   };
    Client* _client;
    uint8_t* buffer;
    uint16_t bufferSize;
@@ -96,10 +140,21 @@ private:
    unsigned long lastOutActivity;
    unsigned long lastInActivity;
    bool pingOutstanding;
+   INFLIGHT inflight[MQTT_MAX_INFLIGHT] = {};
+   INFLIGHT* inflightWriting = NULL; // Slot receiving payload of a beginPublish/endPublish QoS 1 message
+   uint32_t inflightExpected = 0;    // Full length that slot should reach by endPublish()
+   ACK_STATS ackStats = {};
    MQTT_CALLBACK_SIGNATURE;
    uint32_t readPacket(uint8_t*);
-   boolean readByte(uint8_t * result);
-   boolean readByte(uint8_t * result, uint16_t * index);
+   // Packet being received, which may arrive over several loop() calls
+   uint8_t readStage = MQTT_READ_IDLE;
+   uint8_t readLengthLength;
+   uint16_t readLength;           // Bytes of the packet in buffer
+   uint32_t readPosition;         // Bytes of the packet received, including ones that didn't fit in buffer
+   uint32_t readRemaining;        // Bytes of the packet still to come
+   uint32_t readMultiplier;
+   uint32_t readPayloadStart;     // Position of a PUBLISH payload, 0 until known
+   unsigned long readLastActivity;
    boolean write(uint8_t header, uint8_t* buf, uint16_t length);
    uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
    // Build up the header ready to send
@@ -107,11 +162,29 @@ private:
    // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
    //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
    size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   uint16_t nextPacketId();
+   INFLIGHT* findInflight(uint16_t msgId);
+   INFLIGHT* keepInflight(uint16_t msgId, uint8_t header, const uint8_t* buf, uint16_t length);
+   void appendInflight(const uint8_t* buf, size_t size);
+   void handleAck(uint16_t msgId);
+   void resendInflight();
    IPAddress ip;
    const char* domain;
    uint16_t port;
    Stream* stream;
    int _state;
+   // Kept from beginConnect() until the CONNECT packet is sent
+   const char* connectId;
+   const char* connectUser;
+   const char* connectPass;
+   const char* connectWillTopic;
+   const char* connectWillMessage;
+   uint8_t connectWillQos;
+   boolean connectWillRetain;
+   boolean connectCleanSession;
+   uint8_t connackLength;
+   boolean sendConnect();
+   boolean continueConnect();
 public:
    PubSubClient();
    PubSubClient(Client& client);
@@ -147,11 +220,22 @@ public:
    boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Start connecting without waiting for the server. The connection is then advanced by loop(),
+   // with state() going through MQTT_CONNECTING_TCP, MQTT_CONNECT_SENT and MQTT_AWAITING_CONNACK
+   // to MQTT_CONNECTED (or an error). The strings passed in must stay valid until then.
+   // Returns 0 if it couldn't be started
+   boolean beginConnect(const char* id, const char* user, const char* pass);
+   boolean beginConnect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Returns 1 while a connection started with beginConnect() is in progress
+   boolean connecting();
    void disconnect();
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   // Publish with QoS 0 or 1. A QoS 1 message is kept until the broker acknowledges it and is
+   // resent with the DUP flag after a reconnect. Returns 0 if there's no free in-flight slot.
+   boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, uint8_t qos);
    boolean publish_P(const char* topic, const char* payload, boolean retained);
    boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
    // Start to publish a message.
@@ -163,6 +247,7 @@ public:
    // a new buffer and held in memory at one time
    // Returns 1 if the message was started successfully, 0 if there was an error
    boolean beginPublish(const char* topic, unsigned int plength, boolean retained);
+   boolean beginPublish(const char* topic, unsigned int plength, boolean retained, uint8_t qos);
    // Finish off this publish message (started with beginPublish)
    // Returns 1 if the packet was sent successfully, 0 if there was an error
    int endPublish();
@@ -177,6 +262,10 @@ public:
    boolean loop();
    boolean connected();
    int state();
+   // Number of QoS 1 publishes still waiting for a PUBACK
+   uint8_t getInflightCount();
+   ACK_STATS getAckStats();
+   void resetAckStats();
 
 };
 
@@ -0,0 +1,102 @@
+// Humidity Math Library
+// Magnus formula in integer fixed point. Q16 means the value times 65536, Q24 times 16777216.
+
+#include "humidityMath.h"
+
+static const int32_t  MAGNUS_B       = 24312;    // 243.12 °C in 0.01 °C
+static const int32_t  MAGNUS_A_Q16   = 1154744;  // 17.62
+static const int32_t  LOG2_E_Q16     = 94548;    // log2(e)
+static const int32_t  LN_2_Q16       = 45426;    // ln(2)
+static const int32_t  LOG2_10000_Q16 = 870824;   // log2(100 % in 0.01 %)
+static const int32_t  ZERO_CELSIUS   = 27315;    // 273.15 K in 0.01 K
+static const int64_t  ABSOLUTE_Q2    = 132447;   // 6.112 hPa * 216.7 g K / (m³ hPa), times 100
+
+// 2^(i/64), Q24
+static const uint32_t EXP2_TABLE[65] PROGMEM = {
+    16777216, 16959908, 17144589, 17331282, 17520007, 17710787, 17903645, 18098603,
+    18295684, 18494911, 18696307, 18899897, 19105703, 19313750, 19524063, 19736666,
+    19951585, 20168843, 20388467, 20610483, 20834917, 21061794, 21291142, 21522987,
+    21757357, 21994279, 22233781, 22475891, 22720638, 22968049, 23218155, 23470984,
+    23726566, 23984932, 24246111, 24510133, 24777031, 25046835, 25319578, 25595290,
+    25874004, 26155754, 26440571, 26728490, 27019544, 27313768, 27611195, 27911861,
+    28215802, 28523052, 28833647, 29147625, 29465022, 29785875, 30110222, 30438101,
+    30769550, 31104608, 31443315, 31785710, 32131834, 32481727, 32835430, 33192984,
+    33554432
+};
+
+// log2(1 + i/64), Q24
+static const uint32_t LOG2_TABLE[65] PROGMEM = {
+    0, 375270, 744810, 1108793, 1467383, 1820738, 2169009, 2512340,
+    2850868, 3184728, 3514044, 3838941, 4159533, 4475935, 4788255, 5096595,
+    5401057, 5701737, 5998727, 6292118, 6581994, 6868440, 7151536, 7431359,
+    7707984, 7981483, 8251926, 8519380, 8783912, 9045584, 9304457, 9560591,
+    9814042, 10064867, 10313120, 10558852, 10802114, 11042956, 11281425, 11517568,
+    11751428, 11983051, 12212479, 12439752, 12664911, 12887994, 13109041, 13328087,
+    13545168, 13760320, 13973576, 14184969, 14394532, 14602297, 14808293, 15012551,
+    15215099, 15415967, 15615181, 15812769, 16008758, 16203172, 16396036, 16587377,
+    16777216
+};
+
+// table value at a Q16 fraction, interpolated between its two nearest entries (Q24)
+static uint32_t interpolate(const uint32_t* table, uint32_t fraction)
+{
+    uint32_t index = fraction >> 10;
+    uint32_t low = pgm_read_dword(&table[index]);
+    uint32_t high = pgm_read_dword(&table[index + 1]);
+    return low + (((high - low) * (fraction & 0x3FF)) >> 10);
+}
+
+// e^x, x and result Q16; saturates above x = 10.3
+static uint32_t expFixed(int32_t x)
+{
+    int32_t y = ((int64_t)x * LOG2_E_Q16) >> 16;     // x * log2(e), so e^x = 2^y
+    int32_t whole = y >> 16;                         // rounds down, also for negative y
+    uint32_t power = interpolate(EXP2_TABLE, y & 0xFFFF);
+
+    int32_t shift = 8 - whole;                       // Q24 to Q16, times 2^whole
+    if (shift <= 0) return shift < -6 ? UINT32_MAX : power << -shift;
+    if (shift >= 32) return 0;
+    return (power + (1UL << (shift - 1))) >> shift;
+}
+
+// log2(x) of an integer x > 0, Q16
+static int32_t log2Fixed(uint32_t x)
+{
+    int32_t whole = 31 - __builtin_clz(x);
+    uint32_t mantissa = whole >= 16 ? x >> (whole - 16) : x << (16 - whole); // Q16, 1 to 2
+    return (whole << 16) + ((interpolate(LOG2_TABLE, mantissa & 0xFFFF) + 128) >> 8);
+}
+
+// 17.62 * T / (243.12 + T), Q16: ln of the saturation vapour pressure relative to 0 °C
+static int32_t magnusGamma(int32_t temperature)
+{
+    return ((int64_t)temperature * MAGNUS_A_Q16) / (MAGNUS_B + temperature);
+}
+
+int32_t humidityAtTemperature(int32_t humidity, int32_t fromTemperature, int32_t toTemperature)
+{
+    // vapour pressure stays the same, saturation vapour pressure changes by e^(gamma(from) - gamma(to))
+    uint32_t ratio = expFixed(magnusGamma(fromTemperature) - magnusGamma(toTemperature));
+    return ((int64_t)humidity * ratio + 32768) >> 16;
+}
+
+int32_t dewPoint(int32_t temperature, int32_t humidity)
+{
+    if (humidity <= 0) return INT32_MIN;
+
+    // ln(RH / 100 %) + gamma(T), then T = 243.12 * gamma / (17.62 - gamma)
+    int32_t gamma = magnusGamma(temperature) + (((int64_t)(log2Fixed(humidity) - LOG2_10000_Q16) * LN_2_Q16) >> 16);
+    int64_t divisor = MAGNUS_A_Q16 - gamma;
+    int64_t dividend = (int64_t)MAGNUS_B * gamma;
+    return (dividend + (dividend < 0 ? -divisor / 2 : divisor / 2)) / divisor;
+}
+
+int32_t absoluteHumidity(int32_t temperature, int32_t humidity)
+{
+    if (humidity <= 0) return 0;
+
+    // 216.7 * vapour pressure (hPa) / T (K), with vapour pressure = RH * 6.112 hPa * e^gamma(T)
+    int64_t dividend = (int64_t)expFixed(magnusGamma(temperature)) * humidity * ABSOLUTE_Q2;
+    int64_t divisor = (int64_t)(ZERO_CELSIUS + temperature) * 65536 * 100;
+    return (dividend + divisor / 2) / divisor;
+}
@@ -0,0 +1,22 @@
+// Humidity Math Library
+// Magnus formula (17.62, 243.12 °C) in integer fixed point, since the ESP8266 has no FPU.
+// Temperatures are in 0.01 °C, relative humidity in 0.01 %, absolute humidity in 0.01 g/m³.
+// exp() and log2() come from 64 entry tables with linear interpolation. Over -40..85 °C and
+// 0..100 %, with rounding to the unit included, results stay within 0.01 % RH, 0.01 °C dew point
+// and 0.02 g/m³ of the same formula in double precision.
+
+#ifndef HUMIDITYMATH_H_INCLUDED
+#define HUMIDITYMATH_H_INCLUDED
+
+#include <Arduino.h>
+
+// relative humidity the same air has at another temperature (e.g. to correct for a temperature offset)
+int32_t humidityAtTemperature(int32_t humidity, int32_t fromTemperature, int32_t toTemperature);
+
+// temperature at which the air would be saturated, INT32_MIN if humidity is 0
+int32_t dewPoint(int32_t temperature, int32_t humidity);
+
+// grams of water vapour per cubic metre of air
+int32_t absoluteHumidity(int32_t temperature, int32_t humidity);
+
+#endif
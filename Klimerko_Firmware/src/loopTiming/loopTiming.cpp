@@ -0,0 +1,73 @@
+// Loop Timing Library
+// Fixed-size duration statistics (min/avg/max/percentile) for one stage of the main loop.
+
+#include "loopTiming.h"
+
+// count a new duration (in microseconds)
+void loopTiming::record(unsigned long duration)
+{
+    uint8_t bucket = 0;
+    while (bucket < BUCKETS - 1 && (duration >> bucket) != 0)
+    {
+        ++bucket;
+    }
+    ++m_buckets[bucket];
+
+    if (m_count == 0 || duration < m_min) m_min = duration;
+    if (duration > m_max) m_max = duration;
+    m_sum += duration;
+    ++m_count;
+}
+
+unsigned long loopTiming::getCount()
+{
+    return m_count;
+}
+
+unsigned long loopTiming::getMin()
+{
+    return m_min;
+}
+
+unsigned long loopTiming::getAvg()
+{
+    if (m_count == 0) return 0;
+    return m_sum / m_count;
+}
+
+unsigned long loopTiming::getMax()
+{
+    return m_max;
+}
+
+// upper bound of the bucket holding the given percentile, never above the longest recorded duration
+unsigned long loopTiming::getPercentile(uint8_t percent)
+{
+    if (m_count == 0) return 0;
+
+    unsigned long rank = ((uint64_t)m_count * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (uint8_t bucket = 0; bucket < BUCKETS - 1; bucket++)
+    {
+        seen += m_buckets[bucket];
+        if (seen >= rank)
+        {
+            unsigned long upperBound = (1UL << bucket) - 1;
+            return upperBound < m_max ? upperBound : m_max;
+        }
+    }
+    return m_max;
+}
+
+// start the statistics over again
+void loopTiming::reset()
+{
+    m_count = 0;
+    m_min = 0;
+    m_max = 0;
+    m_sum = 0;
+    for (uint8_t bucket = 0; bucket < BUCKETS; bucket++)
+    {
+        m_buckets[bucket] = 0;
+    }
+}
@@ -0,0 +1,31 @@
+// Loop Timing Library
+// Fixed-size duration statistics (min/avg/max/percentile) for one stage of the main loop.
+// Durations are counted into power-of-2 buckets, so memory use doesn't depend on the number of samples.
+
+#ifndef LOOPTIMING_H_INCLUDED
+#define LOOPTIMING_H_INCLUDED
+
+#include <Arduino.h>
+
+class loopTiming
+{
+    public:
+        static const uint8_t BUCKETS = 25; // Bucket n counts durations shorter than 2^n but not 2^(n-1) microseconds, the last one everything longer
+
+        loopTiming() { reset(); }
+        void record(unsigned long duration);
+        unsigned long getCount();
+        unsigned long getMin();
+        unsigned long getAvg();
+        unsigned long getMax();
+        unsigned long getPercentile(uint8_t percent);
+        void reset();
+
+    private:
+        unsigned long m_count;              // number of recorded durations
+        unsigned long m_min;                // shortest recorded duration
+        unsigned long m_max;                // longest recorded duration
+        uint64_t      m_sum;                // sum of all recorded durations
+        unsigned long m_buckets[BUCKETS];   // histogram of recorded durations
+};
+#endif
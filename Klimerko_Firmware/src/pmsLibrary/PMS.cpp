@@ -69,6 +69,56 @@ bool PMS::readUntil(DATA& data, uint16_t timeout)
   return _status == STATUS_OK;
 }
 
+// Non-blocking read. Requests data (in Passive Mode) and returns immediately.
+// Call process() from the main loop; callback is invoked once the data arrives or the timeout passes.
+void PMS::readAsync(DATA& data, READ_CALLBACK callback, uint16_t timeout)
+{
+  // Discard whatever the sensor sent before the request.
+  while (_stream->available())
+  {
+    _stream->read();
+  }
+
+  _data = &data;
+  _index = 0;
+  _readCallback = callback;
+  _readTimeout = timeout;
+  _readStart = millis();
+  _reading = true;
+  requestRead();
+}
+
+// Consumes the bytes that have arrived so far, never waits for more.
+void PMS::process()
+{
+  if (!_reading)
+  {
+    return;
+  }
+
+  while (_stream->available())
+  {
+    loop();
+    if (_status == STATUS_OK)
+    {
+      _reading = false;
+      if (_readCallback) _readCallback(true);
+      return;
+    }
+  }
+
+  if (millis() - _readStart >= _readTimeout)
+  {
+    _reading = false;
+    if (_readCallback) _readCallback(false);
+  }
+}
+
+bool PMS::isReading()
+{
+  return _reading;
+}
+
 void PMS::loop()
 {
   _status = STATUS_WAITING;
@@ -103,7 +153,7 @@ void PMS::loop()
     case 3:
       _frameLen |= ch;
       // Unsupported sensor, different frame length, transmission error e.t.c.
-      if (_frameLen != 2 * 9 + 2 && _frameLen != 2 * 13 + 2)
+      if (!isValidFrameLength(_frameLen))
       {
         _index = 0;
         return;
@@ -123,16 +173,7 @@ void PMS::loop()
         if (_calculatedChecksum == _checksum)
         {
           _status = STATUS_OK;
-
-          // Standard Particles, CF=1.
-          _data->PM_SP_UG_1_0 = makeWord(_payload[0], _payload[1]);
-          _data->PM_SP_UG_2_5 = makeWord(_payload[2], _payload[3]);
-          _data->PM_SP_UG_10_0 = makeWord(_payload[4], _payload[5]);
-
-          // Atmospheric Environment.
-          _data->PM_AE_UG_1_0 = makeWord(_payload[6], _payload[7]);
-          _data->PM_AE_UG_2_5 = makeWord(_payload[8], _payload[9]);
-          _data->PM_AE_UG_10_0 = makeWord(_payload[10], _payload[11]);
+          decode(_payload, _frameLen, *_data);
         }
 
         _index = 0;
@@ -143,7 +184,6 @@ void PMS::loop()
         _calculatedChecksum += ch;
         uint8_t payloadIndex = _index - 4;
 
-        // Payload is common to all sensors (first 2x6 bytes).
         if (payloadIndex < sizeof(_payload))
         {
           _payload[payloadIndex] = ch;
@@ -156,3 +196,107 @@ void PMS::loop()
     _index++;
   }
 }
+
+// Batch parser. Decodes every complete frame found in the buffer directly into frames, without copying.
+// Returns the number of decoded frames. If given, consumed is set to the number of bytes the caller can drop;
+// an incomplete frame at the end of the buffer is left unconsumed so it can be completed on the next call.
+size_t PMS::parse(const uint8_t* buffer, size_t length, DATA* frames, size_t capacity, size_t* consumed)
+{
+  size_t count = 0;
+  size_t pos = 0;
+
+  while (count < capacity && pos + FRAME_HEADER_LENGTH <= length)
+  {
+    if (buffer[pos] != 0x42 || buffer[pos + 1] != 0x4D)
+    {
+      pos++;
+      continue;
+    }
+
+    uint16_t frameLen = makeWord(buffer[pos + 2], buffer[pos + 3]);
+    if (!isValidFrameLength(frameLen))
+    {
+      pos++;
+      continue;
+    }
+
+    size_t frameEnd = pos + FRAME_HEADER_LENGTH + frameLen;
+    if (frameEnd > length)
+    {
+      break;
+    }
+
+    uint16_t calculatedChecksum = 0;
+    for (size_t i = pos; i < frameEnd - 2; i++)
+    {
+      calculatedChecksum += buffer[i];
+    }
+
+    if (calculatedChecksum != makeWord(buffer[frameEnd - 2], buffer[frameEnd - 1]))
+    {
+      pos++;
+      continue;
+    }
+
+    decode(buffer + pos + FRAME_HEADER_LENGTH, frameLen, frames[count++]);
+    pos = frameEnd;
+  }
+
+  // Drop trailing bytes that can't be the start of a frame.
+  if (count < capacity)
+  {
+    while (pos < length && buffer[pos] != 0x42)
+    {
+      pos++;
+    }
+  }
+
+  if (consumed)
+  {
+    *consumed = pos;
+  }
+  return count;
+}
+
+// Frame length field of 24-byte (PMS1003/PMS3003) and 32-byte (PMS5003/PMS7003) frames.
+bool PMS::isValidFrameLength(uint16_t frameLen)
+{
+  return frameLen == 2 * 9 + 2 || frameLen == 2 * 13 + 2;
+}
+
+void PMS::decode(const uint8_t* payload, uint16_t frameLen, DATA& data)
+{
+  // Standard Particles, CF=1.
+  data.PM_SP_UG_1_0 = makeWord(payload[0], payload[1]);
+  data.PM_SP_UG_2_5 = makeWord(payload[2], payload[3]);
+  data.PM_SP_UG_10_0 = makeWord(payload[4], payload[5]);
+
+  // Atmospheric Environment.
+  data.PM_AE_UG_1_0 = makeWord(payload[6], payload[7]);
+  data.PM_AE_UG_2_5 = makeWord(payload[8], payload[9]);
+  data.PM_AE_UG_10_0 = makeWord(payload[10], payload[11]);
+
+  // Particle counts and status are only sent in 32-byte frames (PMS5003/PMS7003).
+  if (frameLen == 2 * 13 + 2)
+  {
+    data.PM_TOTALPARTICLES_0_3 = makeWord(payload[12], payload[13]);
+    data.PM_TOTALPARTICLES_0_5 = makeWord(payload[14], payload[15]);
+    data.PM_TOTALPARTICLES_1_0 = makeWord(payload[16], payload[17]);
+    data.PM_TOTALPARTICLES_2_5 = makeWord(payload[18], payload[19]);
+    data.PM_TOTALPARTICLES_5_0 = makeWord(payload[20], payload[21]);
+    data.PM_TOTALPARTICLES_10_0 = makeWord(payload[22], payload[23]);
+    data.VERSION = payload[24];
+    data.ERROR_CODE = payload[25];
+  }
+  else
+  {
+    data.PM_TOTALPARTICLES_0_3 = 0;
+    data.PM_TOTALPARTICLES_0_5 = 0;
+    data.PM_TOTALPARTICLES_1_0 = 0;
+    data.PM_TOTALPARTICLES_2_5 = 0;
+    data.PM_TOTALPARTICLES_5_0 = 0;
+    data.PM_TOTALPARTICLES_10_0 = 0;
+    data.VERSION = 0;
+    data.ERROR_CODE = 0;
+  }
+}
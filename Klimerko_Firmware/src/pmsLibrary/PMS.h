@@ -22,8 +22,22 @@ public:
     uint16_t PM_AE_UG_1_0;
     uint16_t PM_AE_UG_2_5;
     uint16_t PM_AE_UG_10_0;
+
+    // Number of particles beyond given diameter in 0.1 L of air (32-byte frames only)
+    uint16_t PM_TOTALPARTICLES_0_3;
+    uint16_t PM_TOTALPARTICLES_0_5;
+    uint16_t PM_TOTALPARTICLES_1_0;
+    uint16_t PM_TOTALPARTICLES_2_5;
+    uint16_t PM_TOTALPARTICLES_5_0;
+    uint16_t PM_TOTALPARTICLES_10_0;
+
+    // Sensor status (32-byte frames only)
+    uint8_t VERSION;
+    uint8_t ERROR_CODE;
   };
 
+  typedef void (*READ_CALLBACK)(bool success);
+
   PMS(Stream&);
   void sleep();
   void wakeUp();
@@ -34,22 +48,38 @@ public:
   bool read(DATA& data);
   bool readUntil(DATA& data, uint16_t timeout = SINGLE_RESPONSE_TIME);
 
+  void readAsync(DATA& data, READ_CALLBACK callback, uint16_t timeout = SINGLE_RESPONSE_TIME);
+  void process();
+  bool isReading();
+
+  static size_t parse(const uint8_t* buffer, size_t length, DATA* frames, size_t capacity, size_t* consumed = NULL);
+
 private:
   enum STATUS { STATUS_WAITING, STATUS_OK };
   enum MODE { MODE_ACTIVE, MODE_PASSIVE };
 
-  uint8_t _payload[12];
+  static const uint8_t FRAME_HEADER_LENGTH = 4;
+  static const uint8_t MAX_PAYLOAD_LENGTH = 2 * 13;
+
+  uint8_t _payload[MAX_PAYLOAD_LENGTH];
   Stream* _stream;
   DATA* _data;
   STATUS _status;
   MODE _mode = MODE_ACTIVE;
 
+  READ_CALLBACK _readCallback = NULL;
+  bool _reading = false;
+  uint32_t _readStart;
+  uint16_t _readTimeout;
+
   uint8_t _index = 0;
   uint16_t _frameLen;
   uint16_t _checksum;
   uint16_t _calculatedChecksum;
 
   void loop();
+  static bool isValidFrameLength(uint16_t frameLen);
+  static void decode(const uint8_t* payload, uint16_t frameLen, DATA& data);
 };
 
 #endif
\ No newline at end of file
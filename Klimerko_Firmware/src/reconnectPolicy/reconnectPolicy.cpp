@@ -0,0 +1,86 @@
+// Reconnect Policy Library
+// Exponential backoff with full jitter for reconnect attempts.
+
+#include "reconnectPolicy.h"
+
+reconnectPolicy::reconnectPolicy(unsigned long minDelay, unsigned long maxDelay)
+    : m_minDelay(minDelay), m_maxDelay(maxDelay), m_delay(minDelay), m_lastAttempt(0),
+      m_attempts(0), m_successes(0), m_failures(0), m_lost(false), m_random(1)
+{
+}
+
+// seed the jitter, e.g. with the chip ID so every device gets its own sequence of delays
+void reconnectPolicy::seed(uint32_t seed)
+{
+    m_random = seed ? seed : 1;
+}
+
+// the connection was just lost, make the first attempt at a random point within the shortest delay
+void reconnectPolicy::lost()
+{
+    m_lastAttempt = millis();
+    m_delay = nextRandom() % (m_minDelay + 1);
+    m_lost = true;
+}
+
+// true once the delay since the last attempt has passed
+bool reconnectPolicy::due()
+{
+    return millis() - m_lastAttempt >= m_delay;
+}
+
+// count an attempt and pick the delay before the next one, in case this one fails
+void reconnectPolicy::attempt()
+{
+    m_lastAttempt = millis();
+    ++m_attempts;
+
+    unsigned long backoff = m_minDelay;
+    for (uint8_t i = 0; i <= m_failures && backoff < m_maxDelay; i++)
+    {
+        backoff *= 2;
+    }
+    if (backoff > m_maxDelay) backoff = m_maxDelay;
+    if (m_failures < 255) ++m_failures;
+
+    m_delay = m_minDelay + nextRandom() % (backoff - m_minDelay + 1);
+}
+
+// the connection is back, start over from the shortest delay next time it's lost.
+// Counted once per lost(), also when it came back without an attempt (e.g. on its own)
+void reconnectPolicy::success()
+{
+    m_failures = 0;
+    if (!m_lost) return;
+    m_lost = false;
+    ++m_successes;
+}
+
+unsigned long reconnectPolicy::getDelay()
+{
+    return m_delay;
+}
+
+unsigned long reconnectPolicy::getAttempts()
+{
+    return m_attempts;
+}
+
+unsigned long reconnectPolicy::getSuccesses()
+{
+    return m_successes;
+}
+
+uint8_t reconnectPolicy::getFailures()
+{
+    return m_failures;
+}
+
+// xorshift32
+uint32_t reconnectPolicy::nextRandom()
+{
+    m_random ^= m_random << 13;
+    m_random ^= m_random >> 17;
+    m_random ^= m_random << 5;
+    return m_random;
+}
@@ -0,0 +1,38 @@
+// Reconnect Policy Library
+// Decides when to retry a lost connection: the delay doubles with every failed attempt up to a cap,
+// and each delay is picked at random below that (full jitter) so devices that lost connection
+// at the same time don't all retry at the same time. Seed it with something unique to the device.
+
+#ifndef RECONNECTPOLICY_H_INCLUDED
+#define RECONNECTPOLICY_H_INCLUDED
+
+#include <Arduino.h>
+
+class reconnectPolicy
+{
+    public:
+        reconnectPolicy(unsigned long minDelay, unsigned long maxDelay);
+        void seed(uint32_t seed);
+        void lost();
+        bool due();
+        void attempt();
+        void success();
+        unsigned long getDelay();
+        unsigned long getAttempts();
+        unsigned long getSuccesses();
+        uint8_t getFailures();
+
+    private:
+        uint32_t nextRandom();
+
+        unsigned long m_minDelay;       // shortest delay between attempts (milliseconds)
+        unsigned long m_maxDelay;       // cap of the backoff (milliseconds)
+        unsigned long m_delay;          // delay before the next attempt
+        unsigned long m_lastAttempt;    // when the last attempt was made
+        unsigned long m_attempts;       // attempts made since boot
+        unsigned long m_successes;      // attempts that connected since boot
+        uint8_t       m_failures;       // attempts that failed since the last success
+        bool          m_lost;           // lost() was called and no success() since
+        uint32_t      m_random;         // state of the random number generator
+};
+#endif
@@ -0,0 +1,150 @@
+// Sensor Aggregator Library
+// Moving window over several sensor channels at once. Channels are stored as columns
+// (structure of arrays) sharing a single head index, so a whole row of readings is added
+// with one call and each channel's readings sit next to each other in memory.
+// Readings are fixed-point integers, each channel in a unit of the caller's choice (e.g. 0.01 °C), so
+// nothing here needs floating point. A reading of SENSOR_MISSING marks a channel that had no data for
+// that row; it's left out of the statistics.
+
+#ifndef SENSORAGGREGATOR_H_INCLUDED
+#define SENSORAGGREGATOR_H_INCLUDED
+
+#include <stdint.h>
+
+const int32_t SENSOR_MISSING = INT32_MIN;
+
+template <uint8_t CHANNELS, uint16_t N>
+class SensorAggregator
+{
+    public:
+        struct STATS {
+            uint16_t count;     // number of readings in the window
+            int32_t mean;       // rounded to the nearest unit of the channel
+            int32_t median;
+            int32_t trimmedMean;  // mean without the lowest and highest readings (see getStats)
+            int32_t minimum;
+            int32_t maximum;
+            uint32_t variance;  // population variance, in the channel's unit squared (saturates at UINT32_MAX)
+        };
+
+        SensorAggregator() : m_window(N) { reset(); }
+
+        // use only the last size rows (1 to N) for statistics; starts all channels over again
+        void setWindow(uint16_t size)
+        {
+            m_window = size < 1 ? 1 : (size > N ? N : size);
+            reset();
+        }
+
+        uint16_t getWindow() { return m_window; }
+
+        // add one reading for every channel
+        void addRow(const int32_t* row)
+        {
+            for (uint8_t channel = 0; channel < CHANNELS; channel++)
+            {
+                m_columns[channel][m_next] = row[channel];
+            }
+            if (m_nbrRows < m_window) ++m_nbrRows;
+            if (++m_next >= m_window) m_next = 0;
+        }
+
+        // number of rows in the window
+        uint16_t getRows() { return m_nbrRows; }
+
+        // copy one row of the window into row, index 0 being the oldest (e.g. to keep the window across a reboot)
+        void getRow(uint16_t index, int32_t* row)
+        {
+            uint16_t position = (m_next + m_window - m_nbrRows + index) % m_window;
+            for (uint8_t channel = 0; channel < CHANNELS; channel++)
+            {
+                row[channel] = m_columns[channel][position];
+            }
+        }
+
+        // statistics of every channel; trim is the number of readings dropped from each end for the trimmed mean
+        void getStats(STATS (&stats)[CHANNELS], uint8_t trim = 1)
+        {
+            for (uint8_t channel = 0; channel < CHANNELS; channel++)
+            {
+                stats[channel] = getStats(channel, trim);
+            }
+        }
+
+        // statistics of a single channel, computed in one pass over a sorted copy of its column
+        STATS getStats(uint8_t channel, uint8_t trim = 1)
+        {
+            STATS stats = { 0, SENSOR_MISSING, SENSOR_MISSING, SENSOR_MISSING, SENSOR_MISSING, SENSOR_MISSING, 0 };
+            int32_t sorted[N];
+            uint16_t count = 0;
+
+            const int32_t* column = m_columns[channel];
+            for (uint16_t i = 0; i < m_nbrRows; i++)
+            {
+                int32_t value = column[i];
+                if (value == SENSOR_MISSING) continue;
+                uint16_t j = count++;
+                while (j > 0 && sorted[j - 1] > value)
+                {
+                    sorted[j] = sorted[j - 1];
+                    --j;
+                }
+                sorted[j] = value;
+            }
+            if (count == 0) return stats;
+
+            if (2 * trim >= count) trim = (count - 1) / 2;
+            int64_t sum = 0, trimmedSum = 0, sumSquares = 0;
+            for (uint16_t i = 0; i < count; i++)
+            {
+                sum += sorted[i];
+                sumSquares += (int64_t)sorted[i] * sorted[i];
+                if (i >= trim && i < count - trim) trimmedSum += sorted[i];
+            }
+            // n * sum(x²) - sum(x)², exact in integers for the ranges of sensor readings
+            int64_t spread = (int64_t)count * sumSquares - sum * sum;
+            int64_t variance = (spread + (int64_t)count * count / 2) / ((int64_t)count * count);
+
+            stats.count = count;
+            stats.mean = divideRounded(sum, count);
+            stats.median = (count % 2) ? sorted[count / 2] : divideRounded((int64_t)sorted[count / 2 - 1] + sorted[count / 2], 2);
+            stats.trimmedMean = divideRounded(trimmedSum, count - 2 * trim);
+            stats.minimum = sorted[0];
+            stats.maximum = sorted[count - 1];
+            stats.variance = variance > UINT32_MAX ? UINT32_MAX : (uint32_t)variance;
+            return stats;
+        }
+
+        // forget all readings of one channel (e.g. when its sensor went offline)
+        void resetChannel(uint8_t channel)
+        {
+            for (uint16_t i = 0; i < N; i++)
+            {
+                m_columns[channel][i] = SENSOR_MISSING;
+            }
+        }
+
+        // start all channels over again
+        void reset()
+        {
+            m_nbrRows = 0;
+            m_next = 0;
+            for (uint8_t channel = 0; channel < CHANNELS; channel++)
+            {
+                resetChannel(channel);
+            }
+        }
+
+    private:
+        // division rounding halves away from zero, like round() does
+        static int32_t divideRounded(int64_t dividend, uint16_t divisor)
+        {
+            return dividend < 0 ? -((-dividend + divisor / 2) / divisor) : (dividend + divisor / 2) / divisor;
+        }
+
+        int32_t  m_columns[CHANNELS][N];    // one column of readings per channel
+        uint16_t m_window;                  // number of rows used, at most N
+        uint16_t m_nbrRows;                 // number of rows in the window
+        uint16_t m_next;                    // index to the next row, shared by all channels
+};
+#endif
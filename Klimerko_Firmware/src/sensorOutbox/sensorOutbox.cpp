@@ -0,0 +1,198 @@
+// Sensor Outbox Library
+// Bounded store-and-forward queue of sensor records in flash (LittleFS).
+
+#include "sensorOutbox.h"
+
+// mount the filesystem and pick up records left from before a reboot
+bool SensorOutbox::begin()
+{
+    m_ready = m_fs.begin();
+    if (m_ready)
+    {
+        scan();
+    }
+    return m_ready;
+}
+
+// append a record, dropping the oldest segment if the outbox is full
+bool SensorOutbox::push(RECORD record)
+{
+    if (!m_ready) return false;
+
+    if (m_headCount >= m_recordsPerSegment)
+    {
+        ++m_head;
+        m_headCount = 0;
+    }
+    if (m_head - m_tail >= m_maxSegments)
+    {
+        dropTail();
+    }
+
+    char path[32];
+    segmentPath(m_head, path, sizeof(path));
+    fs::File file = m_fs.open(path, "a");
+    if (!file) return false;
+
+    // a torn write (e.g. power loss) leaves a partial record at the end, cut it off so records stay aligned
+    size_t size = file.size();
+    if (size % sizeof(RECORD) != 0)
+    {
+        file.truncate(size - size % sizeof(RECORD));
+    }
+
+    record.checksum = checksum(record);
+    size_t written = file.write((const uint8_t*)&record, sizeof(RECORD));
+    file.close();
+    if (written != sizeof(RECORD)) return false;
+
+    ++m_headCount;
+    ++m_available;
+    return true;
+}
+
+// read up to max of the oldest records without removing them; records that fail the checksum come back with flags 0
+size_t SensorOutbox::peek(RECORD* records, size_t max)
+{
+    if (!m_ready || m_available == 0) return 0;
+
+    char path[32];
+    segmentPath(m_tail, path, sizeof(path));
+    fs::File file = m_fs.open(path, "r");
+    size_t count = 0;
+    if (file)
+    {
+        file.seek(m_readIndex * sizeof(RECORD));
+        while (count < max && file.read((uint8_t*)&records[count], sizeof(RECORD)) == sizeof(RECORD))
+        {
+            if (records[count].checksum != checksum(records[count]))
+            {
+                records[count].flags = 0;
+            }
+            ++count;
+        }
+        file.close();
+    }
+
+    if (count == 0)
+    {
+        // tail segment is missing or shorter than expected, start over from what's actually stored
+        m_fs.remove(path);
+        scan();
+    }
+    return count;
+}
+
+// remove the given number of oldest records (after they've been sent)
+void SensorOutbox::pop(size_t count)
+{
+    if (!m_ready || count == 0) return;
+    if (count > m_available) count = m_available;
+
+    m_readIndex += count;
+    m_available -= count;
+
+    uint16_t tailCount = (m_tail == m_head) ? m_headCount : segmentCount(m_tail);
+    if (m_readIndex >= tailCount)
+    {
+        char path[32];
+        segmentPath(m_tail, path, sizeof(path));
+        m_fs.remove(path);
+        m_readIndex = 0;
+        if (m_tail == m_head)
+        {
+            m_headCount = 0;
+        }
+        else
+        {
+            ++m_tail;
+        }
+    }
+}
+
+// number of records waiting to be sent
+uint32_t SensorOutbox::available()
+{
+    return m_available;
+}
+
+// number of times the oldest segment was dropped, records peeked before a change in it must not be popped
+uint32_t SensorOutbox::drops()
+{
+    return m_drops;
+}
+
+// delete all stored records
+void SensorOutbox::clear()
+{
+    if (!m_ready) return;
+
+    for (uint32_t segment = m_tail; segment <= m_head; segment++)
+    {
+        char path[32];
+        segmentPath(segment, path, sizeof(path));
+        m_fs.remove(path);
+    }
+    scan();
+}
+
+// find the oldest and newest segment and count the records in between
+void SensorOutbox::scan()
+{
+    bool found = false;
+    m_head = 0;
+    m_tail = 0;
+    m_available = 0;
+    m_readIndex = 0;
+
+    fs::Dir dir = m_fs.openDir(m_directory);
+    while (dir.next())
+    {
+        uint32_t segment = strtoul(dir.fileName().c_str(), NULL, 10);
+        if (!found || segment < m_tail) m_tail = segment;
+        if (!found || segment > m_head) m_head = segment;
+        m_available += dir.fileSize() / sizeof(RECORD);
+        found = true;
+    }
+    m_headCount = found ? segmentCount(m_head) : 0;
+}
+
+void SensorOutbox::segmentPath(uint32_t segment, char* path, size_t size)
+{
+    snprintf(path, size, "%s/%lu", m_directory, (unsigned long)segment);
+}
+
+uint16_t SensorOutbox::segmentCount(uint32_t segment)
+{
+    char path[32];
+    segmentPath(segment, path, sizeof(path));
+    fs::File file = m_fs.open(path, "r");
+    if (!file) return 0;
+    uint16_t count = file.size() / sizeof(RECORD);
+    file.close();
+    return count;
+}
+
+// drop the oldest segment to make room, including records not sent yet
+void SensorOutbox::dropTail()
+{
+    uint16_t tailCount = segmentCount(m_tail);
+    char path[32];
+    segmentPath(m_tail, path, sizeof(path));
+    m_fs.remove(path);
+    m_available -= (tailCount > m_readIndex) ? tailCount - m_readIndex : 0;
+    m_readIndex = 0;
+    ++m_tail;
+    ++m_drops;
+}
+
+uint8_t SensorOutbox::checksum(const RECORD& record)
+{
+    const uint8_t* bytes = (const uint8_t*)&record;
+    uint8_t sum = 0;
+    for (size_t i = 0; i < sizeof(RECORD) - 1; i++)
+    {
+        sum += bytes[i];
+    }
+    return sum;
+}
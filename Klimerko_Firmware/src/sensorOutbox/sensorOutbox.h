@@ -0,0 +1,62 @@
+// Sensor Outbox Library
+// Bounded store-and-forward queue of sensor records in flash (LittleFS).
+// Records are appended to numbered segment files of fixed capacity; a segment is only ever appended to
+// and deleted as a whole once drained, so each record costs one small append and nothing is rewritten
+// in place. When the outbox is full the oldest segment is dropped.
+// The read position lives in RAM: after a reboot a partially drained segment is sent again from its start.
+// Records peeked but not popped yet may be dropped along with their segment, drops() tells when that happened.
+
+#ifndef SENSOROUTBOX_H_INCLUDED
+#define SENSOROUTBOX_H_INCLUDED
+
+#include <Arduino.h>
+#include <FS.h>
+
+class SensorOutbox
+{
+    public:
+        static const uint8_t FLAG_PMS = 0x01;   // PM values are valid
+        static const uint8_t FLAG_BME = 0x02;   // Temperature, humidity and pressure values are valid
+
+        struct RECORD {
+            uint32_t timestamp;     // Unix time (seconds), 0 if the clock wasn't set
+            uint16_t pm1;           // µg/m³
+            uint16_t pm25;          // µg/m³
+            uint16_t pm10;          // µg/m³
+            int16_t  temperature;   // 0.01 °C
+            uint16_t humidity;      // 0.01 %
+            uint16_t pressure;      // 0.1 mbar
+            uint8_t  flags;         // FLAG_PMS | FLAG_BME
+            uint8_t  checksum;      // Sum of all other bytes, detects torn writes
+        } __attribute__((packed));
+
+        SensorOutbox(fs::FS& fs, const char* directory, uint16_t recordsPerSegment = 64, uint8_t maxSegments = 16)
+            : m_fs(fs), m_directory(directory), m_recordsPerSegment(recordsPerSegment), m_maxSegments(maxSegments) {}
+        bool begin();
+        bool push(RECORD record);
+        size_t peek(RECORD* records, size_t max);
+        void pop(size_t count);
+        uint32_t available();
+        uint32_t drops();
+        void clear();
+
+    private:
+        fs::FS&     m_fs;
+        const char* m_directory;
+        uint16_t    m_recordsPerSegment;   // records per segment file
+        uint8_t     m_maxSegments;         // segment files kept at most
+        uint32_t    m_head = 0;            // segment currently appended to
+        uint32_t    m_tail = 0;            // oldest segment
+        uint16_t    m_headCount = 0;       // records in head segment
+        uint16_t    m_readIndex = 0;       // records already drained from tail segment
+        uint32_t    m_available = 0;       // records waiting to be drained
+        uint32_t    m_drops = 0;           // times the oldest segment was dropped to make room, since boot
+        bool        m_ready = false;
+
+        void scan();
+        void segmentPath(uint32_t segment, char* path, size_t size);
+        uint16_t segmentCount(uint32_t segment);
+        void dropTail();
+        static uint8_t checksum(const RECORD& record);
+};
+#endif
@@ -0,0 +1,159 @@
+// Task Scheduler Library
+// Cooperative scheduler for periodic and one-shot tasks with a fixed number of slots.
+
+#include "taskScheduler.h"
+
+taskScheduler::taskScheduler() : m_heapSize(0)
+{
+    for (uint8_t i = 0; i < MAX_TASKS; i++)
+    {
+        m_tasks[i].callback = NULL;
+    }
+}
+
+// add a task run every period milliseconds, returns its slot or NO_TASK if there's no free one
+uint8_t taskScheduler::every(unsigned long period, TASK_CALLBACK callback, uint8_t arg)
+{
+    return add(period, 0, callback, arg);
+}
+
+// add a task run once after delay milliseconds, returns its slot or NO_TASK if there's no free one
+uint8_t taskScheduler::after(unsigned long delay, TASK_CALLBACK callback, uint8_t arg)
+{
+    return add(0, delay, callback, arg);
+}
+
+uint8_t taskScheduler::add(unsigned long period, unsigned long delay, TASK_CALLBACK callback, uint8_t arg)
+{
+    for (uint8_t task = 0; task < MAX_TASKS; task++)
+    {
+        if (m_tasks[task].callback == NULL)
+        {
+            m_tasks[task].callback = callback;
+            m_tasks[task].period = period;
+            m_tasks[task].due = millis() + delay;
+            m_tasks[task].runs = 0;
+            m_tasks[task].overruns = 0;
+            m_tasks[task].arg = arg;
+            push(task);
+            return task;
+        }
+    }
+    return NO_TASK;
+}
+
+// remove a task before it runs (again)
+void taskScheduler::cancel(uint8_t task)
+{
+    if (task >= MAX_TASKS || m_tasks[task].callback == NULL) return;
+    remove(task);
+    m_tasks[task].callback = NULL;
+}
+
+// run the tasks that are due, returns milliseconds until the next one is
+unsigned long taskScheduler::run()
+{
+    // Every task gets at most one turn per call, so a task that's always late can't starve the loop
+    for (uint8_t turns = m_heapSize; turns > 0 && m_heapSize > 0; turns--)
+    {
+        uint8_t task = m_heap[0];
+        unsigned long now = millis();
+        long late = (long)(now - m_tasks[task].due);
+        if (late < 0) break;
+
+        TASK_CALLBACK callback = m_tasks[task].callback;
+        uint8_t arg = m_tasks[task].arg;
+        remove(task);
+        if (m_tasks[task].period > 0)
+        {
+            if ((unsigned long)late >= m_tasks[task].period)
+            {
+                // Missed a whole run, start counting from now instead of catching up
+                ++m_tasks[task].overruns;
+                m_tasks[task].due = now + m_tasks[task].period;
+            }
+            else
+            {
+                m_tasks[task].due += m_tasks[task].period;
+            }
+            ++m_tasks[task].runs;
+            push(task);
+        }
+        else
+        {
+            m_tasks[task].callback = NULL; // free before running, so the task can add itself again
+        }
+        callback(arg);
+    }
+
+    if (m_heapSize == 0) return (unsigned long)-1;
+    long wait = (long)(m_tasks[m_heap[0]].due - millis());
+    return wait > 0 ? wait : 0;
+}
+
+unsigned long taskScheduler::getRunCount(uint8_t task)
+{
+    return task < MAX_TASKS ? m_tasks[task].runs : 0;
+}
+
+unsigned long taskScheduler::getOverruns(uint8_t task)
+{
+    return task < MAX_TASKS ? m_tasks[task].overruns : 0;
+}
+
+bool taskScheduler::earlier(uint8_t a, uint8_t b)
+{
+    return (long)(m_tasks[m_heap[a]].due - m_tasks[m_heap[b]].due) < 0;
+}
+
+void taskScheduler::swap(uint8_t i, uint8_t j)
+{
+    uint8_t task = m_heap[i];
+    m_heap[i] = m_heap[j];
+    m_heap[j] = task;
+    m_tasks[m_heap[i]].heapIndex = i;
+    m_tasks[m_heap[j]].heapIndex = j;
+}
+
+void taskScheduler::siftUp(uint8_t i)
+{
+    while (i > 0 && earlier(i, (i - 1) / 2))
+    {
+        swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+void taskScheduler::siftDown(uint8_t i)
+{
+    while (true)
+    {
+        uint8_t smallest = i;
+        uint8_t left = 2 * i + 1, right = 2 * i + 2;
+        if (left < m_heapSize && earlier(left, smallest)) smallest = left;
+        if (right < m_heapSize && earlier(right, smallest)) smallest = right;
+        if (smallest == i) return;
+        swap(i, smallest);
+        i = smallest;
+    }
+}
+
+void taskScheduler::push(uint8_t task)
+{
+    m_heap[m_heapSize] = task;
+    m_tasks[task].heapIndex = m_heapSize;
+    siftUp(m_heapSize++);
+}
+
+void taskScheduler::remove(uint8_t task)
+{
+    uint8_t i = m_tasks[task].heapIndex;
+    swap(i, --m_heapSize);
+    if (i < m_heapSize)
+    {
+        // The last task took its place, move it to where it belongs
+        uint8_t moved = m_heap[i];
+        siftUp(i);
+        siftDown(m_tasks[moved].heapIndex);
+    }
+}
@@ -0,0 +1,49 @@
+// Task Scheduler Library
+// Cooperative scheduler for periodic and one-shot tasks with a fixed number of slots.
+// Due times are kept in a binary min-heap, so finding the next task to run doesn't scan every slot.
+// Times are in milliseconds (millis()) and compared in a way that survives its rollover.
+
+#ifndef TASKSCHEDULER_H_INCLUDED
+#define TASKSCHEDULER_H_INCLUDED
+
+#include <Arduino.h>
+
+class taskScheduler
+{
+    public:
+        static const uint8_t MAX_TASKS = 12;
+        static const uint8_t NO_TASK = 0xFF;
+        typedef void (*TASK_CALLBACK)(uint8_t arg); // arg is the value given when the task was added
+
+        taskScheduler();
+        uint8_t every(unsigned long period, TASK_CALLBACK callback, uint8_t arg = 0); // first run is right away
+        uint8_t after(unsigned long delay, TASK_CALLBACK callback, uint8_t arg = 0);  // runs once
+        void cancel(uint8_t task);
+        unsigned long run();
+        unsigned long getRunCount(uint8_t task);
+        unsigned long getOverruns(uint8_t task);
+
+    private:
+        struct TASK {
+            TASK_CALLBACK callback;     // NULL if the slot is free
+            unsigned long period;       // 0 for one-shot tasks
+            unsigned long due;
+            unsigned long runs;
+            unsigned long overruns;     // times the task was late by a whole period or more
+            uint8_t arg;
+            uint8_t heapIndex;
+        };
+
+        uint8_t add(unsigned long period, unsigned long delay, TASK_CALLBACK callback, uint8_t arg);
+        bool earlier(uint8_t a, uint8_t b);
+        void swap(uint8_t i, uint8_t j);
+        void siftUp(uint8_t i);
+        void siftDown(uint8_t i);
+        void push(uint8_t task);
+        void remove(uint8_t task);
+
+        TASK    m_tasks[MAX_TASKS];
+        uint8_t m_heap[MAX_TASKS];      // task slots ordered by due time, soonest first
+        uint8_t m_heapSize;
+};
+#endif